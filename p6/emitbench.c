@@ -0,0 +1,123 @@
+/**
+ * Emit benchmark: times the map phase of a job whose mappers only call
+ * MR_Emit, once with the partition mutex and once lock-free, so the two
+ * emit paths can be compared at any number of mapper threads.
+ *
+ * ./emitbench [-l] [-t threads] [-n pairs] [-k keys] [-p partitions]
+ *   -l  use MR_EMIT_LOCKFREE (default MR_EMIT_LOCKED)
+ *   -t  mapper threads, one map task each (default: number of cores)
+ *   -n  pairs emitted by each mapper (default 1000000)
+ *   -k  distinct keys (default 100000)
+ *   -p  partitions (default 16)
+ *
+ * Prints one line: mode, threads, pairs, map phase and total in ms,
+ * and million pairs emitted per second during the map phase.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "unistd.h"
+#include "mapreduce.h"
+
+static char **keys;
+static int numKeys = 100000;
+static long pairsPerMapper = 1000000;
+static double start;
+static double mapEnd;  // Time the last mapper finished
+
+static double Millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Emits pairsPerMapper pairs; the task name is the mapper's number,
+ * which seeds its walk over the keys so mappers do not emit in step
+ */
+void Map(char *file_name) {
+  unsigned long x = atol(file_name) * 2654435761UL + 1;
+  for (long i = 0; i < pairsPerMapper; i++) {
+    x = x * 6364136223846793005UL + 1442695040888963407UL;
+    MR_Emit(keys[(x >> 33) % numKeys], "1");
+  }
+
+  double now = Millis();
+  double seen;
+  __atomic_load(&mapEnd, &seen, __ATOMIC_RELAXED);
+  while (now > seen && !__atomic_compare_exchange(&mapEnd, &seen, &now, 0,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void Reduce(char *key, Getter get_next, int partition_number) {
+  while (get_next(key, partition_number) != NULL) {
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int lockFree = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int partitions = 16;
+  int opt;
+  while ((opt = getopt(argc, argv, "lt:n:k:p:")) != -1) {
+    if (opt == 'l') {
+      lockFree = 1;
+    } else if (opt == 't') {
+      threads = atoi(optarg);
+    } else if (opt == 'n') {
+      pairsPerMapper = atol(optarg);
+    } else if (opt == 'k') {
+      numKeys = atoi(optarg);
+    } else if (opt == 'p') {
+      partitions = atoi(optarg);
+    } else {
+      fprintf(stderr, "usage: emitbench [-l] [-t threads] [-n pairs] "
+              "[-k keys] [-p partitions]\n");
+      exit(1);
+    }
+  }
+  if (threads < 1 || pairsPerMapper < 1 || numKeys < 1 || partitions < 1) {
+    fprintf(stderr, "emitbench: counts must be positive\n");
+    exit(1);
+  }
+
+  keys = malloc(numKeys * sizeof(char *));
+  for (int i = 0; i < numKeys; i++) {
+    keys[i] = malloc(16);
+    snprintf(keys[i], 16, "key%08d", i);
+  }
+
+  // One map task per mapper, named by its number
+  char **tasks = malloc((threads + 1) * sizeof(char *));
+  tasks[0] = argv[0];
+  for (int i = 0; i < threads; i++) {
+    tasks[i + 1] = malloc(16);
+    snprintf(tasks[i + 1], 16, "%d", i);
+  }
+
+  MR_SetEmitMode(lockFree ? MR_EMIT_LOCKFREE : MR_EMIT_LOCKED);
+  start = Millis();
+  MR_Run(threads + 1, tasks, Map, threads, Reduce, threads,
+         MR_DefaultHashPartition, partitions);
+  double end = Millis();
+
+  long pairs = pairsPerMapper * threads;
+  printf("%-8s threads %3d  pairs %10ld  map %9.1f ms  total %9.1f ms  "
+         "%7.2f Mpairs/s\n", lockFree ? "lockfree" : "locked", threads,
+         pairs, mapEnd - start, end - start,
+         pairs / ((mapEnd - start) * 1e3));
+
+  for (int i = 0; i < threads; i++) {
+    free(tasks[i + 1]);
+  }
+  free(tasks);
+  for (int i = 0; i < numKeys; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+  return 0;
+}
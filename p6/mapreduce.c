@@ -5,50 +5,396 @@
  * SortedMerge(): https://www.geeksforgeeks.org/merge-two-sorted-linked-lists/
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <time.h>
 #include "unistd.h"
 #include "mapreduce.h"
 
+// Keys shorter than this are stored inside their record
+#define INLINE_KEY 16
+
+// Leading bytes of a longer key kept inside its record
+#define KEY_PREFIX 8
+
 // Linked list that maps keys to values
+// Short keys live in the record, NUL-padded, so comparing two of them
+// never leaves the record's cache line. Long keys live on the heap with
+// their first KEY_PREFIX bytes copied into the record.
 struct keyVal {
+  struct keyVal *next;
+  char *val;
+  unsigned int len;
+  union {
+    char inl[INLINE_KEY];
+    struct {
+      char prefix[KEY_PREFIX];
+      char *ptr;
+    } ext;
+  } key;
+};
+
+// Records per chunk on the lock-free emit path
+#define CHUNK_RECORDS 256
+
+// Block of preallocated records. Emitters claim slots with an atomic
+// increment and publish a record by setting its ready flag last.
+struct recordChunk {
+  struct keyVal recs[CHUNK_RECORDS];
+  unsigned char ready[CHUNK_RECORDS];
+  int claimed;                // Slots handed out, may exceed CHUNK_RECORDS
+  struct recordChunk *next;   // Previously filled chunk
+};
+
+// Intermediate bytes per partition that MR_AUTO aims for
+#define TARGET_PARTITION_BYTES (64L << 20)
+
+// Partitions listed by footprint in the memory stats
+#define TOP_PARTITIONS 5
+
+// Upper bound on the partition count MR_AUTO picks
+#define MAX_AUTO_PARTITIONS 65536
+
+// First word of every map output cache file ("MRC2")
+#define CACHE_MAGIC 0x3243524d
+
+// A map task is duplicated once it has run this many times longer than
+// the median finished task, and for at least SPECULATE_MIN_SECONDS
+#define SPECULATE_FACTOR 2.0
+#define SPECULATE_MIN_SECONDS 0.1
+
+// Default number of queued input files read ahead of the mappers
+#define PREFETCH_DEPTH 4
+
+// Bytes buffered per partition output file before a write()
+#define OUTPUT_BUFFER (1 << 20)
+
+// Stack size of each coroutine mapper, not counting the guard page below
+// it that turns an overflow into a fault
+#define COROUTINE_STACK (256 << 10)
+
+// Target size of a data block in table output
+#define TABLE_BLOCK_SIZE 4096
+
+// Last word of every table output file ("MRT1")
+#define TABLE_MAGIC 0x3154524d
+
+// Table output file layout:
+// [ data blocks | index | Bloom filter | footer ]
+// A data block holds front-coded entries (shared key length, unshared key
+// length, value length, key suffix, value and a NUL), then the offsets of
+// its restart entries and their count as 32-bit words. The index holds
+// each block's last key, offset and size.
+struct tableFooter {
+  unsigned long indexOff;
+  unsigned long indexSize;
+  unsigned long bloomOff;
+  unsigned long bloomSize;   // 0 if the table has no Bloom filter
+  unsigned long count;       // Number of entries
+  unsigned int bloomHashes;
+  unsigned int magic;
+};
+
+// Table output state of one partition
+struct tableBuilder {
+  unsigned char *block;      // Data block being filled
+  size_t blockUsed;
+  size_t blockCap;
+  unsigned int *restarts;    // Restart offsets in the current block
+  int blockCount;            // Entries in the current block
+  char *lastKey;
+  size_t lastLen;
+  size_t lastCap;
+  unsigned char *index;
+  size_t indexUsed;
+  size_t indexCap;
+  unsigned long *hashes;     // Key hashes for the Bloom filter
+  long count;
+};
+
+// Reader for a table written with MR_OUTPUT_TABLE
+struct MR_Table {
+  unsigned char *map;
+  size_t size;
+  long numBlocks;
+  unsigned char **blockKeys; // Last key of each block
+  size_t *blockKeyLens;
+  unsigned long *blockOffs;
+  unsigned long *blockSizes;
+  unsigned char *bloom;
+  unsigned long bloomBits;
+  unsigned int bloomHashes;
+  char *key;                 // Decoded key of the current entry
+  size_t keyCap;
+};
+
+// Buffered writer for one partition's output file
+struct outWriter {
+  int fd;
+  char *buf;   // NULL until the partition first calls MR_Output()
+  size_t used;
+  unsigned long offset;          // Bytes written to the file so far
+  struct tableBuilder *table;    // Only for MR_OUTPUT_TABLE
+};
+
+// Slot in the map-side join table; key is NULL when the slot is empty
+struct joinEntry {
   char *key;
   char *val;
-  struct keyVal *next;
+  unsigned long hash;
+};
+
+// Pairs emitted by one map task, held back until the task finishes
+struct mapTask {
+  int file;               // Index into FILES
+  struct keyVal *head;    // Emitted pairs, newest first
+  long count;
+  long bytes;             // Key and value bytes, NULs included
+  long footprint;         // Bytes the buffered pairs take, records included
+};
+
+// Progress of one input file's map task, for speculative execution
+struct taskState {
+  double start;           // Start of the first attempt, in seconds
+  int attempts;
+  int committed;          // Set by the attempt whose pairs are kept
+};
+
+// Header of a cached map output. The mapper version must match, then the
+// input file's identity is checked; if it changed, the content hash
+// decides whether the cache holds. The header is followed by count
+// NUL-terminated key and value pairs, bytes in all.
+struct cacheHeader {
+  unsigned int magic;
+  unsigned long version;  // HashKey() of the version given to MR_SetCacheDir
+  unsigned long dev;
+  unsigned long ino;
+  long size;
+  long mtimeSec;
+  long mtimeNsec;
+  unsigned long contentHash;
+  long count;
+  long bytes;
+};
+
+// Scheduling states of a coroutine mapper
+#define CO_READY   0   // Runnable
+#define CO_IDLE    1   // Runnable, but only waiting for other tasks
+#define CO_WAITING 2   // Resumed once waitFd is readable
+#define CO_DONE    3
+
+// Mapper coroutine, always resumed by the worker thread that started it
+struct coroutine {
+  ucontext_t ctx;
+  char *stack;
+  int state;
+  int waitFd;
+};
+
+// Worker thread that multiplexes a fixed set of coroutine mappers
+struct coWorker {
+  ucontext_t sched;           // Scheduler loop the coroutines switch to
+  struct coroutine *cos;
+  int count;
+  struct coroutine *current;  // Coroutine being run, if any
+};
+
+// Phases that performance counters are split by
+#define PHASE_MAP    0
+#define PHASE_SORT   1   // Linking, sorting and encoding a partition
+#define PHASE_REDUCE 2   // Decoding a partition and calling the reducer
+#define NUM_PHASES   3
+
+// Counters read by MR_SetCounters(), in the order of counterEvents
+#define NUM_COUNTERS 5
+
+// Performance counters of one mapper, worker or reducer thread
+// A counter the kernel or CPU does not provide has an fd of -1
+struct threadCounters {
+  int fds[NUM_COUNTERS];
+  unsigned long last[NUM_COUNTERS];   // Values at the last phase switch
+  unsigned long totals[NUM_PHASES][NUM_COUNTERS];
+  int phase;                          // Phase being counted
+  int reducer;                        // Set for reducer threads
+  struct threadCounters *next;
+};
+
+// Choices and estimates reported at the end of MR_Run
+struct runStats {
+  int numMappers;
+  int numReducers;
+  int numPartitions;
+  int autoMappers;       // Set when the count was picked by MR_AUTO
+  int autoReducers;
+  int autoPartitions;
+  long inputBytes;
+  long samplePairs;      // Pairs emitted by the sampling pass, if any
+  long sampleBytes;      // Bytes of pairs emitted by the sampling pass
+  long sampleKeys;       // Distinct keys seen by the sampling pass
+  long estBytes;         // Estimated intermediate bytes for the whole job
+  long estKeys;          // Estimated distinct keys for the whole job
+  long cacheHits;        // Input files whose map output came from the cache
+  long cacheMisses;
+  long specAttempts;     // Duplicate attempts launched for stragglers
+  long specWins;         // Tasks whose duplicate finished first
+  int coWorkers;         // Worker threads running coroutine mappers
+  long coSwitches;       // Times a coroutine mapper gave up its worker
+  long pairBytes;        // Intermediate bytes once mapping finished
+  long runBytes;         // Bytes of the encoded runs
+  long outputFiles;      // Partitions that allocated an output buffer
+  long peakRss;          // Peak resident set size, in bytes
+  long bufferPeak;       // Most bytes held at once in task buffers
+  int overBudget;        // Set once pairs exceeded the memory budget
 };
 
 // Structure for partition information
+// Footprint counters sit next to count, which every emit updates anyway
 typedef struct partStruct {
     struct keyVal *head;
+    struct recordChunk *chunks;
+    long count;
+    long keyBytes;      // Keys too long to be stored in their records
+    long valueBytes;    // Values the records point to, NULs included
+    long keys;          // Distinct keys, counted while reducing
     pthread_mutex_t lock;
 } partStruct;
 
+// Partitions with at least this many pairs are sorted in parallel
+#define PARALLEL_SORT_MIN 16384
+
+// Piece of a partition sort that any reducer thread may pick up:
+// either sorts list a, or merges sorted lists a and b, into *out
+struct sortTask {
+  struct keyVal *a;
+  struct keyVal *b;
+  int merge;
+  struct keyVal **out;
+  int *pending;            // Unfinished tasks in the owner's round
+  struct sortTask *next;
+};
+
+// Number of keys between restart points in a table block
+#define RESTART_INTERVAL 16
+
+// Sorted partition stored as front-coded entries. Each entry holds the
+// length of the prefix it shares with the previous key, the length of the
+// rest of the key, and those remaining bytes. The reducer reads a run from
+// the front, so unlike a table block it has no restart points.
+struct fcRun {
+  unsigned char *data;  // Encoded entries
+  size_t used;
+  size_t cap;
+  char **vals;          // Values in key order
+  int count;            // Number of entries
+
+  // Reader state
+  int pos;              // Index of the next unread entry
+  size_t off;           // Byte offset of the next unread entry
+  char *key;            // Current key, decoded lazily
+  size_t keyLen;
+  size_t keyCap;
+  int groupDone;        // Set once every value of the current key is read
+};
+
 // Function pointers
 Partitioner partitioner;
 Reducer reducer;
 Mapper mapper;
 
+// Settings
+int emitMode = MR_EMIT_LOCKED;
+char *outputPrefix = "part";
+int outputFormat = MR_OUTPUT_TEXT;
+int bloomBitsPerKey;
+int prefetchDepth = PREFETCH_DEPTH;
+char *joinFile;
+Mapper joinLoader;
+long targetPartitionBytes = TARGET_PARTITION_BYTES;
+int autoSample;
+FILE *statsOut;
+char *cacheDir;
+char *cacheVersion = "";
+int speculate;
+int mapMode = MR_MAP_THREADS;
+int countersOn;
+long memoryBudget;
+
 // Trackers
 int NUM_PARTITIONS;
+int NUM_REDUCERS;
 int NUM_FILES;
 
 // Counters for multi-threading
 int currFile;
 int nextPart;
+int prefetched;            // Files already handed to the prefetcher
 
 // Locks
 pthread_key_t glob_var_key;
+pthread_key_t taskKey;        // Map task of the calling thread, if buffered
+pthread_key_t coKey;          // Coroutine worker of the calling thread
+pthread_key_t counterKey;     // Performance counters of the calling thread
 pthread_mutex_t fileLock;
+pthread_cond_t prefetchCond;  // Signalled when a mapper takes a file
+pthread_cond_t taskCond;      // Signalled when a map task is committed
+
+// Shared sort work
+struct sortTask *sortQueue;
+pthread_mutex_t sortLock;
+pthread_cond_t sortCond;   // Signalled when tasks are queued or finish
+int busyReducers;          // Reducer threads that may still queue tasks
 
 // Structs
 struct partStruct *partitions;
-struct partStruct *backups;
-int *nextKey;
+struct fcRun *runs;
+struct outWriter *writers;
 char **FILES;
+char **cacheData;             // Pairs loaded from the cache, per input file
+
+// Speculative execution, guarded by fileLock
+struct taskState *taskStates;
+double *taskTimes;            // Durations of committed tasks, sorted
+int tasksDone;
+long bufferedBytes;           // Pairs held by tasks awaiting their commit
+int tasksLeft;                // Tasks whose pairs are not yet committed
+
+// Distinct key seen by the sampling pass; count 0 marks an empty slot
+struct sampleKey {
+  char *key;
+  unsigned long hash;
+  int count;                   // Times the key was emitted
+};
+
+// Stats and the MR_AUTO sampling pass
+struct runStats stats;
+int sampling;                  // MR_Emit only records key statistics
+struct sampleKey *sampleTable;  // Distinct sampled keys
+unsigned long sampleSize;
+
+// Performance counters of every thread, guarded by fileLock
+struct threadCounters *counterList;
+int counterErrno;             // Why the first cycle counter failed to open
+
+// Map-side join table: open addressing, size is a power of two
+struct joinEntry *joinTable;
+unsigned long joinSize;
+unsigned long joinUsed;
 
 /**
  * Initializes global variables
@@ -62,13 +408,139 @@ Reducer reduce, int num_reducers, Partitioner partition, int num_partitions) {
 
   // Trackers
   NUM_PARTITIONS = num_partitions;
+  NUM_REDUCERS = num_reducers;
   NUM_FILES = argc - 1;
 
+  // Counters, left at the previous job's end by an earlier MR_Run
+  currFile = 0;
+  nextPart = 0;
+  prefetched = 0;
+
   // Data structures
-  partitions = malloc((num_partitions + 1) * sizeof(struct partStruct));
-  backups = malloc((num_partitions + 1) * sizeof(struct partStruct));
-  nextKey = calloc(num_partitions, sizeof(int));
+  partitions = calloc(num_partitions + 1, sizeof(struct partStruct));
+  for (int i = 0; i < num_partitions; i++) {
+    pthread_mutex_init(&partitions[i].lock, NULL);
+  }
+  runs = calloc(num_partitions, sizeof(struct fcRun));
+  writers = calloc(num_partitions, sizeof(struct outWriter));
   FILES = &argv[1];
+  cacheData = calloc(NUM_FILES, sizeof(char *));
+  taskStates = calloc(NUM_FILES, sizeof(struct taskState));
+  taskTimes = calloc(NUM_FILES, sizeof(double));
+  tasksDone = 0;
+  bufferedBytes = 0;
+  tasksLeft = NUM_FILES;
+}
+
+/**
+ * Selects how MR_Emit adds pairs to partitions
+ */
+void MR_SetEmitMode(int mode) {
+  emitMode = mode;
+}
+
+/**
+ * Selects whether mappers run as threads or as coroutines
+ */
+void MR_SetMapMode(int mode) {
+  mapMode = mode;
+}
+
+/**
+ * Sets how many queued input files are read ahead of the mappers
+ * A depth of 0 turns prefetching off
+ */
+void MR_SetPrefetchDepth(int depth) {
+  prefetchDepth = depth;
+}
+
+/**
+ * Sets the small side of a map-side join
+ * MR_Run calls load(file_name) once before mapping; load should add
+ * each record with MR_JoinPut()
+ */
+void MR_SetJoinTable(char *file_name, Mapper load) {
+  joinFile = file_name;
+  joinLoader = load;
+}
+
+/**
+ * Sets the intermediate bytes per partition that MR_AUTO aims for
+ */
+void MR_SetTargetPartitionSize(long bytes) {
+  targetPartitionBytes = bytes;
+}
+
+/**
+ * With MR_AUTO counts, first maps one input file to measure how many
+ * intermediate bytes and distinct keys the job produces
+ * The mapper runs twice on that file, so it must not have side effects
+ * other than MR_Emit()
+ */
+void MR_SetAutoSample(int enable) {
+  autoSample = enable;
+}
+
+/**
+ * Records performance counters for each phase and thread of MR_Run
+ * Printed with the stats; counters the system lacks are shown as n/a
+ */
+void MR_SetCounters(int enable) {
+  countersOn = enable;
+}
+
+/**
+ * Sets the bytes of intermediate pairs the job should stay within
+ */
+void MR_SetMemoryBudget(long bytes) {
+  memoryBudget = bytes;
+}
+
+/**
+ * Prints the counts used and the run's statistics to out after MR_Run
+ */
+void MR_SetStats(FILE *out) {
+  statsOut = out;
+}
+
+/**
+ * Turns on incremental mode: each input file's map output is cached in
+ * dir, and files that have not changed since the last run are not mapped
+ * again. Values must stay valid until MR_Run returns, as for MR_Emit().
+ * Output cached under another version is ignored, so change version
+ * whenever the mapper changes. NULL is the same as "".
+ */
+void MR_SetCacheDir(char *dir, char *version) {
+  cacheDir = dir;
+  cacheVersion = version != NULL ? version : "";
+}
+
+/**
+ * Turns on speculative execution: once the input queue is empty, idle
+ * mappers rerun tasks that take far longer than the median task. Each
+ * attempt's pairs are buffered, and count toward the memory budget,
+ * and only the first attempt to finish adds them to the partitions. The
+ * others are cancelled: see MR_Cancelled().
+ */
+void MR_SetSpeculation(int enable) {
+  speculate = enable;
+}
+
+/**
+ * Sets the prefix of the files written by MR_Output()
+ */
+void MR_SetOutput(char *prefix) {
+  outputPrefix = prefix;
+}
+
+/**
+ * Selects text lines or sorted tables for MR_Output() files
+ * Tables get a Bloom filter with bloom_bits_per_key bits per key,
+ * or none if it is 0
+ */
+void MR_SetOutputFormat(int format, int bloom_bits_per_key) {
+  outputFormat = format;
+  bloomBitsPerKey = bloom_bits_per_key;
 }
 
 /** 
@@ -96,19 +568,65 @@ unsigned long MR_SortedPartition(char *key, int num_partitions) {
     return -1;
   }
 
-  int sigBits = 0;
-  int temp = num_partitions;
+  // Scale the 32-bit key into [0, num_partitions). For a power of two
+  // this is the key's top log2(num_partitions) bits, but any count works.
+  unsigned long partition =
+      ((unsigned long)(unsigned)atoi(key) * num_partitions) >> 32;
+
+  return partition;
+}
+
+/**
+ * Returns a record's key as a C string
+ */
+char *KeyOf(struct keyVal *rec) {
+  return rec->len < INLINE_KEY ? rec->key.inl : rec->key.ext.ptr;
+}
+
+/**
+ * Copies key into a record, inline if it is short enough
+ */
+void SetKey(struct keyVal *rec, char *key) {
+  size_t len = strlen(key);
+
+  rec->len = len;
+  if (len < INLINE_KEY) {
+    memset(rec->key.inl, 0, INLINE_KEY);
+    memcpy(rec->key.inl, key, len);
+  } else {
+    memcpy(rec->key.ext.prefix, key, KEY_PREFIX);
+    rec->key.ext.ptr = malloc(len + 1);
+    memcpy(rec->key.ext.ptr, key, len + 1);
+  }
+}
 
-  // Calculate log2(num_partitions)
-  while (temp != 1) {
-    temp /= 2;
-    sigBits++;
+/**
+ * Frees a record's key if it is stored out of line
+ */
+void FreeKey(struct keyVal *rec) {
+  if (rec->len >= INLINE_KEY) {
+    free(rec->key.ext.ptr);
   }
+}
 
-  // Shift significant bits and assign to partition
-  unsigned long partition = (unsigned)atoi(key) >> (32 - sigBits);
+/**
+ * Heap bytes taken by a key of len bytes besides its record
+ */
+size_t KeyHeapBytes(size_t len) {
+  return len < INLINE_KEY ? 0 : len + 1;
+}
 
-  return partition;
+/**
+ * Compares the keys of two records, like strcmp
+ * The first KEY_PREFIX bytes sit at the same place in every record and
+ * are NUL-padded, so most comparisons are decided there
+ */
+int CompareRecords(struct keyVal *a, struct keyVal *b) {
+  int c = memcmp(a->key.inl, b->key.inl, KEY_PREFIX);
+  if (c != 0 || a->len < KEY_PREFIX || b->len < KEY_PREFIX) {
+    return c;
+  }
+  return strcmp(KeyOf(a) + KEY_PREFIX, KeyOf(b) + KEY_PREFIX);
 }
 
 /**
@@ -153,25 +671,26 @@ void FrontBackSplit(struct keyVal* source, struct keyVal** frontRef,
  * order, and splices their nodes together 
  * to make one big sorted list which  
  * is returned." 
+ *
+ * Uses the dummy node version so large partitions cannot overflow the stack
  */
 struct keyVal* SortedMerge(struct keyVal* a, struct keyVal* b) {
-  struct keyVal* result = NULL;
-
-  /* Base cases */
-  if (a == NULL)
-    return b;
-  else if (b == NULL)
-    return a;
-
-  /* Pick either a or b, and recur */
-  if (strcmp(a->key, b->key) <= 0) {
-    result = a;
-    result->next = SortedMerge(a->next, b);
-  } else {
-    result = b;
-    result->next = SortedMerge(a, b->next);
+  struct keyVal dummy;
+  struct keyVal* tail = &dummy;
+
+  /* Move the smaller head onto the tail until one list runs out */
+  while (a != NULL && b != NULL) {
+    if (CompareRecords(a, b) <= 0) {
+      tail->next = a;
+      a = a->next;
+    } else {
+      tail->next = b;
+      b = b->next;
+    }
+    tail = tail->next;
   }
-  return result;
+  tail->next = (a != NULL) ? a : b;
+  return dummy.next;
 }
 
 /**
@@ -199,202 +718,2423 @@ void MergeSort(struct keyVal** head) {
 }
 
 /**
- * Sets head of backups equal to the passed partition
- * If the head is not null, set next partition equal to current head
- * Then set head equal to passed partition
+ * Runs a sort task and marks it finished in its owner's round
  */
-void backup(struct keyVal *currPart, int partition_number) {
-  if (backups[partition_number].head == NULL) {
-    backups[partition_number].head = currPart;
-    currPart->next = NULL;
+void RunSortTask(struct sortTask *task) {
+  if (task->merge) {
+    *task->out = SortedMerge(task->a, task->b);
   } else {
-    currPart->next = backups[partition_number].head;
-    backups[partition_number].head = currPart;
+    MergeSort(&task->a);
+    *task->out = task->a;
   }
+
+  pthread_mutex_lock(&sortLock);
+  (*task->pending)--;
+  pthread_cond_broadcast(&sortCond);
+  pthread_mutex_unlock(&sortLock);
 }
 
 /**
- * Returns a pointer to the value passed by MR_Emit(),
- * If the flag is set, reset flag and return NULL
- * If key is not found in the passed partition, return NULL
+ * Queues all but the first task for other reducer threads,
+ * runs the first one, then helps with queued tasks until the round is done
  */
-char *get_next(char *key, int partition_number) {
-  struct keyVal *currPart = partitions[partition_number].head;
+void RunRound(struct sortTask *tasks, int n) {
+  int pending = n;
 
-  pthread_mutex_lock(&partitions[partition_number].lock);
-  if (nextKey[partition_number] == 1) {
-    nextKey[partition_number] = 0;
-    pthread_mutex_unlock(&partitions[partition_number].lock);
-    return NULL;
+  pthread_mutex_lock(&sortLock);
+  for (int i = 0; i < n; i++) {
+    tasks[i].pending = &pending;
+    if (i > 0) {
+      tasks[i].next = sortQueue;
+      sortQueue = &tasks[i];
+    }
   }
-  if (currPart != NULL) {
-    if (strcmp(currPart->key, key) == 0) {
-      partitions[partition_number].head = currPart->next;
-      if (currPart->next != NULL) {
-        if (strcmp(currPart->next->key, key) != 0) {
-          nextKey[partition_number] = 1;
-          pthread_mutex_unlock(&partitions[partition_number].lock);
-          backup(currPart, partition_number);
-          return currPart->val;
-        }
-        pthread_mutex_unlock(&partitions[partition_number].lock);
-        backup(currPart, partition_number);
-        return currPart->val;
-      } else {
-        pthread_mutex_unlock(&partitions[partition_number].lock);
-        backup(currPart, partition_number);
-        return currPart->val;
-      }
+  pthread_cond_broadcast(&sortCond);
+  pthread_mutex_unlock(&sortLock);
+
+  RunSortTask(&tasks[0]);
+
+  pthread_mutex_lock(&sortLock);
+  while (pending > 0) {
+    if (sortQueue != NULL) {
+      struct sortTask *task = sortQueue;
+      sortQueue = task->next;
+      pthread_mutex_unlock(&sortLock);
+      RunSortTask(task);
+      pthread_mutex_lock(&sortLock);
+    } else {
+      pthread_cond_wait(&sortCond, &sortLock);
     }
   }
-  pthread_mutex_unlock(&partitions[partition_number].lock);
-  return NULL;
+  pthread_mutex_unlock(&sortLock);
 }
 
 /**
- * Takes key-value pairs from various mappers,
- * storing them in a partition so later reducers can access them
+ * Sorts a partition, splitting large ones into one chunk per reducer thread
+ * The chunks are sorted and then merged pairwise in rounds of shared tasks
  */
-void MR_Emit(char *key, char *value) {
-  if (strlen(key) == 0) {
+void ParallelSort(struct keyVal **head, long count) {
+  // Every chunk needs at least one record, so never cut more chunks
+  // than there are records
+  int k = count < NUM_REDUCERS ? (int)count : NUM_REDUCERS;
+  if (count < PARALLEL_SORT_MIN || k < 2) {
+    MergeSort(head);
     return;
   }
 
-  // Create new key-value node
-  int partitionNum = partitioner(key, NUM_PARTITIONS);
-  struct keyVal *new = malloc(sizeof(struct keyVal));
-  new->key = malloc(sizeof(char) * (strlen(key) + 1));
-  strcpy(new->key, key);
-  new->val = value;
+  struct keyVal *lists[k];
+  struct sortTask tasks[k];
 
-  pthread_mutex_lock(&partitions[partitionNum].lock);
-  struct keyVal *iter = partitions[partitionNum].head;
-  if (iter == NULL) {
-    partitions[partitionNum].head = new;
-    new->next = NULL;
-    pthread_mutex_unlock(&partitions[partitionNum].lock);
-    return;
+  // Cut the list into k chunks of nearly equal length
+  struct keyVal *iter = *head;
+  for (int i = 0; i < k; i++) {
+    long len = count / k + (i < count % k);
+    lists[i] = iter;
+    for (long j = 1; j < len; j++) {
+      iter = iter->next;
+    }
+    struct keyVal *temp = iter->next;
+    iter->next = NULL;
+    iter = temp;
   }
 
-  // Add to linked list
-  new->next = partitions[partitionNum].head;
-  partitions[partitionNum].head = new;
-  pthread_mutex_unlock(&partitions[partitionNum].lock);
-  return;
+  for (int i = 0; i < k; i++) {
+    tasks[i].a = lists[i];
+    tasks[i].merge = 0;
+    tasks[i].out = &lists[i];
+  }
+  RunRound(tasks, k);
+
+  // Merge neighbouring chunks until one list is left
+  while (k > 1) {
+    int m = k / 2;
+    for (int i = 0; i < m; i++) {
+      tasks[i].a = lists[2 * i];
+      tasks[i].b = lists[2 * i + 1];
+      tasks[i].merge = 1;
+      tasks[i].out = &lists[i];
+    }
+    RunRound(tasks, m);
+    if (k % 2 == 1) {
+      lists[m] = lists[k - 1];
+    }
+    k = m + k % 2;
+  }
+  *head = lists[0];
 }
 
 /**
- * Helper function that calls the mapper,
- * assigning files to mapper threads
+ * Runs queued sort tasks for busy reducer threads
+ * Returns once every reducer thread has run out of partitions
  */
-void *mapping() {
-  while (1) {
-    char *file;
+void HelpSort() {
+  pthread_mutex_lock(&sortLock);
+  busyReducers--;
+  pthread_cond_broadcast(&sortCond);
 
-    pthread_mutex_lock(&fileLock);
-    if (NUM_FILES <= currFile) {
-      pthread_mutex_unlock(&fileLock);
-      return NULL;
+  while (1) {
+    if (sortQueue != NULL) {
+      struct sortTask *task = sortQueue;
+      sortQueue = task->next;
+      pthread_mutex_unlock(&sortLock);
+      RunSortTask(task);
+      pthread_mutex_lock(&sortLock);
+    } else if (busyReducers == 0) {
+      break;
+    } else {
+      pthread_cond_wait(&sortCond, &sortLock);
     }
-    file = FILES[currFile];
-    currFile++;
-
-    pthread_mutex_unlock(&fileLock);
-    mapper(file);
   }
+  pthread_mutex_unlock(&sortLock);
 }
 
 /**
- * Helper function that calls the reducer,
- * assigning partitions to reducer threads
+ * Appends an unsigned LEB128 varint at data[*used], advancing *used
+ * The caller makes room for up to 10 bytes
  */
-void *reduction() {
-  while (1) {
-    pthread_mutex_lock(&fileLock);
-    if (NUM_PARTITIONS <= nextPart) {
-      pthread_mutex_unlock(&fileLock);
-      return NULL;
-    }
+void PutVarint(unsigned char *data, size_t *used, size_t v) {
+  while (v >= 0x80) {
+    data[(*used)++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  data[(*used)++] = (unsigned char)v;
+}
 
-    struct keyVal *iter = partitions[nextPart].head;
-    int *part = malloc(sizeof(int));
-    *part = nextPart;
-    pthread_setspecific(glob_var_key, part);
-    nextPart++;
-    pthread_mutex_unlock(&fileLock);
+/**
+ * Grows a byte buffer so it holds at least need bytes
+ */
+void Reserve(unsigned char **data, size_t *cap, size_t need) {
+  if (need <= *cap) {
+    return;
+  }
+  while (*cap < need) {
+    *cap = *cap ? *cap * 2 : 256;
+  }
+  *data = realloc(*data, *cap);
+}
 
-    int *glob_spec_var = pthread_getspecific(glob_var_key);
-    MergeSort(&partitions[*glob_spec_var].head);
-    iter = partitions[*glob_spec_var].head;
+/**
+ * Reads a varint at *off and advances *off past it
+ */
+size_t GetVarint(unsigned char *data, size_t *off) {
+  size_t v = 0;
+  int shift = 0;
+  while (data[*off] & 0x80) {
+    v |= (size_t)(data[(*off)++] & 0x7f) << shift;
+    shift += 7;
+  }
+  v |= (size_t)data[(*off)++] << shift;
+  return v;
+}
 
-    while (iter != NULL) {
-      reducer(iter->key, get_next, *glob_spec_var);
-      iter = partitions[*glob_spec_var].head;
+/**
+ * Reads a varint at *off into *v, as GetVarint() does, but without
+ * reading at or past end or taking more than 64 bits
+ * Returns 0 if the varint does not fit
+ */
+int GetVarintBounded(unsigned char *data, size_t *off, size_t end,
+        size_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64 && *off < end; shift += 7) {
+    unsigned char byte = data[(*off)++];
+    *v |= (size_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return 1;
     }
-    free(part);
   }
+  return 0;
 }
 
 /**
- * Creates threads and runs the computation
+ * Frees a record and its key once it has been encoded
+ * Records on the lock-free path are freed with their chunk
  */
-void MR_Run(int argc, char *argv[], Mapper map, int num_mappers,
-Reducer reduce, int num_reducers, Partitioner partition, int num_partitions) {
-  // Exit if there is no file specified
-  if (argc < 2) {
-    printf("No file specified\n");
-    exit(0);
+void FreeRecord(struct keyVal *rec) {
+  FreeKey(rec);
+  if (emitMode == MR_EMIT_LOCKED) {
+    free(rec);
   }
+}
 
-  // Inititalize global variables
-  initialize(argc, argv, map, num_mappers, reduce,
-          num_reducers, partition, num_partitions);
-
-  // Create mapper threads
-  int kMapThreads = num_mappers;
-  pthread_t mappers[kMapThreads];
-  for (int i = 0; i < num_mappers; i++) {
-    if (i < NUM_FILES) {
-      pthread_create(&mappers[i], NULL, mapping, NULL);
-    }
+/**
+ * Front-codes a sorted list of key-value nodes into the run,
+ * freeing the nodes and their keys as they are encoded
+ */
+void EncodeRun(struct fcRun *run, struct keyVal *head) {
+  int count = 0;
+  for (struct keyVal *iter = head; iter != NULL; iter = iter->next) {
+    count++;
   }
-  // Join mapper threads
-  for (int i = 0; i < num_mappers; i++) {
-    if (i < NUM_FILES) {
-      pthread_join(mappers[i], NULL);
+
+  run->vals = malloc(count * sizeof(char *));
+
+  struct keyVal *prev = NULL;
+  struct keyVal *iter = head;
+  while (iter != NULL) {
+    char *key = KeyOf(iter);
+    size_t len = iter->len;
+    size_t shared = 0;
+
+    if (prev != NULL) {
+      char *prevKey = KeyOf(prev);
+      while (shared < len && shared < prev->len &&
+              prevKey[shared] == key[shared]) {
+        shared++;
+      }
     }
-  }
 
-  // Create reducer threads
-  int kRedThreads = num_reducers;
-  pthread_t reducers[kRedThreads];
-  pthread_key_create(&glob_var_key, NULL);
-  for (int i = 0; i < num_reducers; i++) {
-    if (i < NUM_PARTITIONS) {
-      pthread_create(&reducers[i], NULL, reduction, NULL);
+    // Two varints of at most 10 bytes each, then the unshared bytes
+    Reserve(&run->data, &run->cap, run->used + 20 + (len - shared));
+    PutVarint(run->data, &run->used, shared);
+    PutVarint(run->data, &run->used, len - shared);
+    memcpy(run->data + run->used, key + shared, len - shared);
+    run->used += len - shared;
+    run->vals[run->count++] = iter->val;
+
+    // The previous record is only needed until this one is encoded
+    if (prev != NULL) {
+      FreeRecord(prev);
     }
+    prev = iter;
+    iter = iter->next;
   }
-  // Join reducer threads
-  for (int i = 0; i < num_reducers; i++) {
-    if (i < NUM_PARTITIONS) {
-      pthread_join(reducers[i], NULL);
-    }
+  if (prev != NULL) {
+    FreeRecord(prev);
   }
+}
 
-  // Free partitions and corresponding keys
-  for (int i = 0; i < NUM_PARTITIONS; i++) {
-    struct keyVal *iter = backups[i].head;
-    struct keyVal *temp;
-    while (iter != NULL) {
-      free(iter->key);
-      temp = iter;
-      iter = iter->next;
-      free(temp);
-    }
+/**
+ * Decodes the key of the next unread entry into the run's key buffer
+ * The buffer still holds the previous key, so only the suffix is copied
+ */
+void DecodeKey(struct fcRun *run) {
+  size_t off = run->off;
+  size_t shared = GetVarint(run->data, &off);
+  size_t unshared = GetVarint(run->data, &off);
+
+  if (shared + unshared + 1 > run->keyCap) {
+    run->keyCap = (shared + unshared + 1) * 2;
+    run->key = realloc(run->key, run->keyCap);
+  }
+  memcpy(run->key + shared, run->data + off, unshared);
+  run->keyLen = shared + unshared;
+  run->key[run->keyLen] = '\0';
+}
+
+/**
+ * Returns 1 if the next unread entry has the same key as the current one
+ * Compares on the encoded form, without decoding the entry
+ */
+int SameKey(struct fcRun *run) {
+  size_t off = run->off;
+  size_t shared = GetVarint(run->data, &off);
+  size_t unshared = GetVarint(run->data, &off);
+
+  if (shared + unshared != run->keyLen) {
+    return 0;
+  }
+  return memcmp(run->data + off, run->key + shared, unshared) == 0;
+}
+
+/**
+ * Returns a pointer to the value passed by MR_Emit(),
+ * If every value of the current key has been returned, return NULL
+ */
+char *get_next(char *key, int partition_number) {
+  struct fcRun *run = &runs[partition_number];
+
+  if (run->groupDone) {
+    return NULL;
+  }
+  char *val = run->vals[run->pos];
+
+  // Step past the current entry
+  GetVarint(run->data, &run->off);
+  run->off += GetVarint(run->data, &run->off);
+  run->pos++;
+
+  if (run->pos == run->count || !SameKey(run)) {
+    run->groupDone = 1;
+  }
+  return val;
+}
+
+/**
+ * Full 64-bit version of the hash used by MR_DefaultHashPartition
+ */
+unsigned long HashKey(char *key) {
+  unsigned long hash = 5381;
+  int c;
+  while ((c = *key++) != '\0')
+    hash = hash * 33 + c;
+  return hash;
+}
+
+/**
+ * Spreads the bits of a key hash for Bloom filter probes and
+ * the slots of open-addressed tables
+ */
+unsigned long MixHash(unsigned long h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53UL;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+ * Returns the join table slot holding key, or the empty slot it belongs in
+ */
+struct joinEntry *JoinSlot(char *key, unsigned long hash) {
+  unsigned long i = hash & (joinSize - 1);
+  while (joinTable[i].key != NULL) {
+    if (joinTable[i].hash == hash && strcmp(joinTable[i].key, key) == 0) {
+      break;
+    }
+    i = (i + 1) & (joinSize - 1);
+  }
+  return &joinTable[i];
+}
+
+/**
+ * Adds a record to the join table, replacing any value already stored
+ * for the key. Must not be called while mappers are running.
+ */
+void MR_JoinPut(char *key, char *value) {
+  // Keep the table at most half full
+  if (2 * (joinUsed + 1) > joinSize) {
+    struct joinEntry *old = joinTable;
+    unsigned long oldSize = joinSize;
+
+    joinSize = joinSize ? joinSize * 2 : 1024;
+    joinTable = calloc(joinSize, sizeof(struct joinEntry));
+    for (unsigned long i = 0; i < oldSize; i++) {
+      if (old[i].key != NULL) {
+        *JoinSlot(old[i].key, old[i].hash) = old[i];
+      }
+    }
+    free(old);
+  }
+
+  unsigned long hash = HashKey(key);
+  struct joinEntry *slot = JoinSlot(key, hash);
+  if (slot->key == NULL) {
+    slot->key = strdup(key);
+    slot->hash = hash;
+    joinUsed++;
+  } else {
+    free(slot->val);
+  }
+  slot->val = strdup(value);
+}
+
+/**
+ * Looks up a key in the join table, returning NULL if it is not there
+ * The table is read-only while mapping, so mappers probe it without locks
+ */
+char *MR_JoinGet(char *key) {
+  if (joinTable == NULL) {
+    return NULL;
+  }
+  return JoinSlot(key, HashKey(key))->val;
+}
+
+/**
+ * Frees the join table
+ */
+void FreeJoinTable() {
+  for (unsigned long i = 0; i < joinSize; i++) {
+    free(joinTable[i].key);
+    free(joinTable[i].val);
+  }
+  free(joinTable);
+  joinTable = NULL;
+  joinSize = 0;
+  joinUsed = 0;
+}
+
+/**
+ * Records an emitted pair during the sampling pass
+ */
+void SampleEmit(char *key, char *value) {
+  stats.samplePairs++;
+  stats.sampleBytes += sizeof(struct keyVal) + KeyHeapBytes(strlen(key)) +
+      strlen(value) + 1;
+
+  // Keep the set of distinct keys at most half full
+  if (2 * (stats.sampleKeys + 1) > sampleSize) {
+    struct sampleKey *old = sampleTable;
+    unsigned long oldSize = sampleSize;
+
+    sampleSize = sampleSize ? sampleSize * 2 : 1024;
+    sampleTable = calloc(sampleSize, sizeof(struct sampleKey));
+    for (unsigned long i = 0; i < oldSize; i++) {
+      if (old[i].count != 0) {
+        unsigned long j = old[i].hash & (sampleSize - 1);
+        while (sampleTable[j].count != 0) {
+          j = (j + 1) & (sampleSize - 1);
+        }
+        sampleTable[j] = old[i];
+      }
+    }
+    free(old);
+  }
+
+  // djb2 differs by little between similar keys, so mix it before
+  // picking a slot, and compare keys since hashes may still collide
+  unsigned long hash = MixHash(HashKey(key));
+  unsigned long i = hash & (sampleSize - 1);
+  while (sampleTable[i].count != 0 && (sampleTable[i].hash != hash ||
+          strcmp(sampleTable[i].key, key) != 0)) {
+    i = (i + 1) & (sampleSize - 1);
+  }
+  if (sampleTable[i].count == 0) {
+    sampleTable[i].key = strdup(key);
+    sampleTable[i].hash = hash;
+    stats.sampleKeys++;
+  }
+  sampleTable[i].count++;
+}
+
+/**
+ * Replaces MR_AUTO counts with ones picked from the core count and the
+ * input size. Partitions are sized to hold about targetPartitionBytes
+ * of intermediate data, estimated from a sampling pass if enabled.
+ */
+void ChooseCounts(int argc, char *argv[], int *num_mappers,
+        int *num_reducers, int *num_partitions) {
+  int files = argc - 1;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) {
+    cores = 1;
+  }
+
+  long firstBytes = 0;
+  for (int i = 1; i < argc; i++) {
+    struct stat st;
+    if (stat(argv[i], &st) == 0) {
+      stats.inputBytes += st.st_size;
+      if (i == 1) {
+        firstBytes = st.st_size;
+      }
+    }
+  }
+
+  if (*num_mappers == MR_AUTO) {
+    *num_mappers = cores < files ? cores : files;
+    stats.autoMappers = 1;
+  }
+  if (*num_reducers == MR_AUTO) {
+    *num_reducers = cores;
+    stats.autoReducers = 1;
+  }
+
+  if (*num_partitions == MR_AUTO) {
+    // Without a sample, assume the pairs take as much space as the input
+    stats.estBytes = stats.inputBytes;
+    stats.estKeys = 0;
+
+    if (autoSample && firstBytes > 0) {
+      sampling = 1;
+      mapper(argv[1]);
+      sampling = 0;
+
+      double scale = (double)stats.inputBytes / firstBytes;
+      long estPairs = stats.samplePairs * scale;
+      stats.estBytes = stats.sampleBytes * scale;
+
+      // Chao1 estimate: keys seen once or twice hint at unseen ones
+      double once = 0;
+      double twice = 0;
+      for (unsigned long i = 0; i < sampleSize; i++) {
+        once += sampleTable[i].count == 1;
+        twice += sampleTable[i].count == 2;
+        free(sampleTable[i].key);
+      }
+      stats.estKeys = stats.sampleKeys + (twice > 0 ?
+          once * once / (2 * twice) : once * (once - 1) / 2);
+      if (stats.estKeys > estPairs) {
+        stats.estKeys = estPairs;
+      }
+
+      free(sampleTable);
+      sampleTable = NULL;
+      sampleSize = 0;
+    }
+
+    // Each reducer holds a partition's pairs and its encoded copy at once,
+    // so leave room for one more partition per reducer in the budget
+    long target = targetPartitionBytes;
+    if (memoryBudget > 0) {
+      long spare = (memoryBudget - stats.estBytes) / *num_reducers;
+      if (spare < 1) {
+        fprintf(stderr, "MR_Run: about %ld bytes of pairs expected, over "
+                "the %ld byte memory budget\n", stats.estBytes, memoryBudget);
+        spare = 1;
+      }
+      if (spare < target) {
+        target = spare;
+      }
+    }
+    long parts = (stats.estBytes + target - 1) / target;
+    if (parts < *num_reducers) {
+      parts = *num_reducers;
+    }
+    // Partitions beyond the number of keys would stay empty
+    if (stats.estKeys > 0 && parts > stats.estKeys) {
+      parts = stats.estKeys;
+    }
+    if (parts > MAX_AUTO_PARTITIONS) {
+      parts = MAX_AUTO_PARTITIONS;
+    }
+    *num_partitions = parts;
+    stats.autoPartitions = 1;
+  }
+
+  stats.numMappers = *num_mappers;
+  stats.numReducers = *num_reducers;
+  stats.numPartitions = *num_partitions;
+}
+
+// Events behind each counter, and their names in the stats
+unsigned int counterTypes[NUM_COUNTERS] = {
+  PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+  PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE
+};
+unsigned long counterEvents[NUM_COUNTERS] = {
+  PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+  PERF_COUNT_SW_CONTEXT_SWITCHES
+};
+char *counterNames[NUM_COUNTERS] = {
+  "cycles", "instr", "cache-miss", "branch-miss", "ctx-switch"
+};
+char *phaseNames[NUM_PHASES] = { "map", "sort", "reduce" };
+
+/**
+ * Opens a counter for the calling thread, or returns -1
+ * Kernel time is excluded when the system only allows user counting
+ */
+int OpenCounter(int c) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = counterTypes[c];
+  attr.config = counterEvents[c];
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+      PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_hv = 1;
+
+  int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+    attr.exclude_kernel = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  return fd;
+}
+
+/**
+ * Reads a counter, scaled up for any time it was multiplexed out
+ */
+unsigned long ReadCounter(int fd) {
+  unsigned long v[3];
+  if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v) || v[2] == 0) {
+    return 0;
+  }
+  return v[2] < v[1] ? (unsigned long)((double)v[0] * v[1] / v[2]) : v[0];
+}
+
+/**
+ * Starts counting for the calling thread, attributed to phase
+ */
+void StartCounters(int phase, int reducer) {
+  if (!countersOn) {
+    return;
+  }
+
+  struct threadCounters *tc = calloc(1, sizeof(struct threadCounters));
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    tc->fds[c] = OpenCounter(c);
+    if (tc->fds[c] < 0 && c == 0 && counterErrno == 0) {
+      counterErrno = errno;
+    }
+    tc->last[c] = ReadCounter(tc->fds[c]);
+  }
+  tc->phase = phase;
+  tc->reducer = reducer;
+  pthread_setspecific(counterKey, tc);
+
+  pthread_mutex_lock(&fileLock);
+  tc->next = counterList;
+  counterList = tc;
+  pthread_mutex_unlock(&fileLock);
+}
+
+/**
+ * Charges the calling thread's counts so far to its current phase,
+ * and counts from now on towards phase
+ */
+void SwitchPhase(int phase) {
+  struct threadCounters *tc = pthread_getspecific(counterKey);
+  if (tc == NULL) {
+    return;
+  }
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    unsigned long now = ReadCounter(tc->fds[c]);
+    tc->totals[tc->phase][c] += now - tc->last[c];
+    tc->last[c] = now;
+  }
+  tc->phase = phase;
+}
+
+/**
+ * Stops counting for the calling thread
+ * Its totals are kept for PrintStats()
+ */
+void StopCounters() {
+  struct threadCounters *tc = pthread_getspecific(counterKey);
+  if (tc == NULL) {
+    return;
+  }
+  SwitchPhase(tc->phase);
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    if (tc->fds[c] >= 0) {
+      close(tc->fds[c]);
+    }
+  }
+  pthread_setspecific(counterKey, NULL);
+}
+
+/**
+ * Prints one row of counter totals, n/a for counters that did not open
+ */
+void PrintCounterRow(char *label, unsigned long *totals, int *open) {
+  fprintf(statsOut, "    %-12s", label);
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    if (open[c]) {
+      fprintf(statsOut, " %14lu", totals[c]);
+    } else {
+      fprintf(statsOut, " %14s", "n/a");
+    }
+  }
+  if (open[0] && open[1] && totals[0] > 0) {
+    fprintf(statsOut, "  IPC %.2f", (double)totals[1] / totals[0]);
+  }
+  fprintf(statsOut, "\n");
+}
+
+/**
+ * Prints counter totals per phase, then per thread
+ */
+void PrintCounters() {
+  if (counterList == NULL) {
+    return;
+  }
+
+  // A counter is shown if it opened on any thread
+  int open[NUM_COUNTERS] = { 0 };
+  unsigned long phases[NUM_PHASES][NUM_COUNTERS];
+  memset(phases, 0, sizeof(phases));
+  for (struct threadCounters *tc = counterList; tc != NULL; tc = tc->next) {
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      open[c] |= tc->fds[c] >= 0;
+      for (int p = 0; p < NUM_PHASES; p++) {
+        phases[p][c] += tc->totals[p][c];
+      }
+    }
+  }
+
+  fprintf(statsOut, "  %-14s", "counters");
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    fprintf(statsOut, " %14s", counterNames[c]);
+  }
+  fprintf(statsOut, "\n");
+  for (int p = 0; p < NUM_PHASES; p++) {
+    PrintCounterRow(phaseNames[p], phases[p], open);
+  }
+
+  // Threads were added newest first; print them in start order
+  int count = 0;
+  for (struct threadCounters *tc = counterList; tc != NULL; tc = tc->next) {
+    count++;
+  }
+  struct threadCounters *threads[count];
+  int i = count;
+  for (struct threadCounters *tc = counterList; tc != NULL; tc = tc->next) {
+    threads[--i] = tc;
+  }
+  int n[2] = { 0, 0 };
+  for (i = 0; i < count; i++) {
+    struct threadCounters *tc = threads[i];
+    unsigned long sum[NUM_COUNTERS] = { 0 };
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      for (int p = 0; p < NUM_PHASES; p++) {
+        sum[c] += tc->totals[p][c];
+      }
+    }
+    char label[32];
+    snprintf(label, sizeof(label), "%s %d", tc->reducer ? "reducer" : "mapper",
+            n[tc->reducer]++);
+    PrintCounterRow(label, sum, open);
+  }
+  if (!open[0]) {
+    fprintf(statsOut, "    hardware counters unavailable: %s\n",
+            strerror(counterErrno));
+  }
+}
+
+/**
+ * Frees the counter totals of every thread
+ */
+void FreeCounters() {
+  while (counterList != NULL) {
+    struct threadCounters *tc = counterList;
+    counterList = tc->next;
+    free(tc);
+  }
+  counterErrno = 0;
+}
+
+/**
+ * Adds a record to its partition's count and footprint
+ * Atomic on both emit paths: lock-free emitters update them concurrently,
+ * and the memory budget reads them without the partition lock
+ */
+void CountPair(struct partStruct *part, struct keyVal *rec) {
+  __atomic_fetch_add(&part->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&part->keyBytes, KeyHeapBytes(rec->len),
+          __ATOMIC_RELAXED);
+  __atomic_fetch_add(&part->valueBytes, strlen(rec->val) + 1,
+          __ATOMIC_RELAXED);
+}
+
+/**
+ * Bytes a partition's pairs take, records included
+ */
+long PartitionBytes(struct partStruct *part) {
+  return __atomic_load_n(&part->count, __ATOMIC_RELAXED) *
+      sizeof(struct keyVal) +
+      __atomic_load_n(&part->keyBytes, __ATOMIC_RELAXED) +
+      __atomic_load_n(&part->valueBytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Bytes the pairs of every partition take
+ */
+long TotalPairBytes() {
+  long total = 0;
+  for (int i = 0; i < NUM_PARTITIONS; i++) {
+    total += PartitionBytes(&partitions[i]);
+  }
+  return total;
+}
+
+/**
+ * Warns once if the pairs emitted so far exceed the memory budget
+ */
+void CheckBudget() {
+  if (memoryBudget <= 0 || __atomic_load_n(&stats.overBudget,
+          __ATOMIC_RELAXED)) {
+    return;
+  }
+  long total = TotalPairBytes() +
+      __atomic_load_n(&bufferedBytes, __ATOMIC_RELAXED);
+  if (total > memoryBudget &&
+          !__atomic_exchange_n(&stats.overBudget, 1, __ATOMIC_RELAXED)) {
+    fprintf(stderr, "MR_Run: pairs use %ld bytes, over the %ld byte "
+            "memory budget\n", total, memoryBudget);
+  }
+}
+
+/**
+ * Prints where the job's memory went: the pairs' footprint, what it
+ * costs per pair and per distinct key, and the largest partitions
+ */
+void PrintMemory() {
+  long pairs = 0;
+  long keys = 0;
+  long keyBytes = 0;
+  long valueBytes = 0;
+  int top[TOP_PARTITIONS];
+  int numTop = 0;
+  for (int i = 0; i < NUM_PARTITIONS; i++) {
+    pairs += partitions[i].count;
+    keys += partitions[i].keys;
+    keyBytes += partitions[i].keyBytes;
+    valueBytes += partitions[i].valueBytes;
+
+    // Insert into the largest partitions seen so far
+    long bytes = PartitionBytes(&partitions[i]);
+    int j = numTop < TOP_PARTITIONS ? numTop++ : TOP_PARTITIONS;
+    for (; j > 0 && PartitionBytes(&partitions[top[j - 1]]) < bytes; j--) {
+      if (j < TOP_PARTITIONS) {
+        top[j] = top[j - 1];
+      }
+    }
+    if (j < TOP_PARTITIONS) {
+      top[j] = i;
+    }
+  }
+
+  fprintf(statsOut, "  pairs            %ld\n", pairs);
+  fprintf(statsOut, "  distinct keys    %ld\n", keys);
+  fprintf(statsOut, "  pair bytes       %ld\n", stats.pairBytes);
+  fprintf(statsOut, "    records        %ld\n",
+          pairs * (long)sizeof(struct keyVal));
+  fprintf(statsOut, "    long keys      %ld\n", keyBytes);
+  fprintf(statsOut, "    values         %ld\n", valueBytes);
+  fprintf(statsOut, "  encoded runs     %ld\n", stats.runBytes);
+  long buffers = stats.outputFiles < stats.numReducers ?
+      stats.outputFiles : stats.numReducers;
+  fprintf(statsOut, "  output buffers   %ld\n", buffers * OUTPUT_BUFFER);
+  if (pairs > 0) {
+    fprintf(statsOut, "  bytes per pair   %.1f\n",
+            (double)stats.pairBytes / pairs);
+  }
+  if (keys > 0) {
+    fprintf(statsOut, "  bytes per key    %.1f\n",
+            (double)stats.pairBytes / keys);
+  }
+  if (stats.bufferPeak > 0) {
+    fprintf(statsOut, "  task buffers     %ld peak\n", stats.bufferPeak);
+  }
+  fprintf(statsOut, "  peak RSS         %ld\n", stats.peakRss);
+  if (memoryBudget > 0) {
+    fprintf(statsOut, "  memory budget    %ld%s\n", memoryBudget,
+            stats.overBudget ? " (exceeded)" : "");
+  }
+  for (int i = 0; i < numTop; i++) {
+    struct partStruct *part = &partitions[top[i]];
+    fprintf(statsOut, "  %-16s #%d: %ld bytes, %ld pairs, %ld keys\n",
+            i == 0 ? "top partitions" : "", top[i], PartitionBytes(part),
+            part->count, part->keys);
+  }
+}
+
+/**
+ * Prints the run's statistics to the stream set by MR_SetStats()
+ */
+void PrintStats() {
+  if (statsOut == NULL) {
+    return;
+  }
+  fprintf(statsOut, "MR_Run stats\n");
+  fprintf(statsOut, "  mappers          %d%s\n", stats.numMappers,
+          stats.autoMappers ? " (auto)" : "");
+  fprintf(statsOut, "  reducers         %d%s\n", stats.numReducers,
+          stats.autoReducers ? " (auto)" : "");
+  fprintf(statsOut, "  partitions       %d%s\n", stats.numPartitions,
+          stats.autoPartitions ? " (auto)" : "");
+  fprintf(statsOut, "  input bytes      %ld\n", stats.inputBytes);
+  if (stats.autoPartitions) {
+    fprintf(statsOut, "  est. pair bytes  %ld\n", stats.estBytes);
+  }
+  if (stats.samplePairs > 0) {
+    fprintf(statsOut, "  sampled pairs    %ld\n", stats.samplePairs);
+    fprintf(statsOut, "  sampled keys     %ld\n", stats.sampleKeys);
+    fprintf(statsOut, "  est. keys        %ld\n", stats.estKeys);
+  }
+  if (cacheDir != NULL) {
+    fprintf(statsOut, "  cache hits       %ld\n", stats.cacheHits);
+    fprintf(statsOut, "  cache misses     %ld\n", stats.cacheMisses);
+  }
+  if (speculate) {
+    fprintf(statsOut, "  spec. attempts   %ld\n", stats.specAttempts);
+    fprintf(statsOut, "  spec. wins       %ld\n", stats.specWins);
+  }
+  if (mapMode == MR_MAP_COROUTINES) {
+    fprintf(statsOut, "  map workers      %d\n", stats.coWorkers);
+    fprintf(statsOut, "  map switches     %ld\n", stats.coSwitches);
+  }
+  PrintMemory();
+  PrintCounters();
+}
+
+/**
+ * Copies a record into a partition without taking its lock
+ * Claims a slot in the newest chunk, or pushes a new chunk with a CAS
+ */
+void EmitLockFree(struct partStruct *part, struct keyVal *rec) {
+  while (1) {
+    struct recordChunk *chunk = __atomic_load_n(&part->chunks,
+            __ATOMIC_ACQUIRE);
+    if (chunk != NULL) {
+      int slot = __atomic_fetch_add(&chunk->claimed, 1, __ATOMIC_RELAXED);
+      if (slot < CHUNK_RECORDS) {
+        chunk->recs[slot] = *rec;
+        __atomic_store_n(&chunk->ready[slot], 1, __ATOMIC_RELEASE);
+        CountPair(part, rec);
+        return;
+      }
+    }
+
+    // Chunk is full: start a new one holding this record
+    struct recordChunk *fresh = calloc(1, sizeof(struct recordChunk));
+    fresh->recs[0] = *rec;
+    fresh->ready[0] = 1;
+    fresh->claimed = 1;
+    fresh->next = chunk;
+    if (__atomic_compare_exchange_n(&part->chunks, &chunk, fresh, 0,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      CountPair(part, rec);
+      return;
+    }
+    // Another emitter pushed a chunk first
+    free(fresh);
+  }
+}
+
+/**
+ * Links every record in a partition's chunks into its list for sorting
+ */
+void LinkChunks(struct partStruct *part) {
+  for (struct recordChunk *chunk = part->chunks; chunk != NULL;
+          chunk = chunk->next) {
+    int n = chunk->claimed < CHUNK_RECORDS ? chunk->claimed : CHUNK_RECORDS;
+    for (int i = 0; i < n; i++) {
+      chunk->recs[i].next = part->head;
+      part->head = &chunk->recs[i];
+    }
+  }
+}
+
+/**
+ * Frees a partition's record chunks
+ */
+void FreeChunks(struct partStruct *part) {
+  struct recordChunk *chunk = part->chunks;
+  while (chunk != NULL) {
+    struct recordChunk *temp = chunk;
+    chunk = chunk->next;
+    free(temp);
+  }
+  part->chunks = NULL;
+}
+
+/**
+ * Returns the number of pairs emitted to a partition so far
+ * Safe to call while mappers are running
+ */
+long MR_PartitionCount(int partition_number) {
+  return __atomic_load_n(&partitions[partition_number].count,
+          __ATOMIC_RELAXED);
+}
+
+/**
+ * Calls visit on every pair emitted to a partition so far
+ * Safe to call while mappers are running; with MR_EMIT_LOCKED
+ * the partition lock is held for the whole scan
+ */
+void MR_PartitionScan(int partition_number, Visitor visit) {
+  struct partStruct *part = &partitions[partition_number];
+
+  if (emitMode == MR_EMIT_LOCKED) {
+    pthread_mutex_lock(&part->lock);
+    for (struct keyVal *iter = part->head; iter != NULL; iter = iter->next) {
+      visit(KeyOf(iter), iter->val);
+    }
+    pthread_mutex_unlock(&part->lock);
+    return;
+  }
+
+  for (struct recordChunk *chunk = __atomic_load_n(&part->chunks,
+          __ATOMIC_ACQUIRE); chunk != NULL; chunk = chunk->next) {
+    int n = __atomic_load_n(&chunk->claimed, __ATOMIC_RELAXED);
+    if (n > CHUNK_RECORDS) {
+      n = CHUNK_RECORDS;
+    }
+    // Slots that are claimed but not yet published are skipped
+    for (int i = 0; i < n; i++) {
+      if (__atomic_load_n(&chunk->ready[i], __ATOMIC_ACQUIRE)) {
+        visit(KeyOf(&chunk->recs[i]), chunk->recs[i].val);
+      }
+    }
+  }
+}
+
+/**
+ * Creates a record holding a copy of key
+ */
+struct keyVal *NewRecord(char *key, char *value) {
+  struct keyVal *new = malloc(sizeof(struct keyVal));
+  SetKey(new, key);
+  new->val = value;
+  return new;
+}
+
+/**
+ * Stores a record in its partition, which takes ownership of it
+ */
+void AddRecord(struct keyVal *new) {
+  int partitionNum = partitioner(KeyOf(new), NUM_PARTITIONS);
+
+  if (emitMode == MR_EMIT_LOCKFREE) {
+    EmitLockFree(&partitions[partitionNum], new);
+    free(new);
+    return;
+  }
+
+  pthread_mutex_lock(&partitions[partitionNum].lock);
+  CountPair(&partitions[partitionNum], new);
+  struct keyVal *iter = partitions[partitionNum].head;
+  if (iter == NULL) {
+    partitions[partitionNum].head = new;
+    new->next = NULL;
+    pthread_mutex_unlock(&partitions[partitionNum].lock);
+    return;
+  }
+
+  // Add to linked list
+  new->next = partitions[partitionNum].head;
+  partitions[partitionNum].head = new;
+  pthread_mutex_unlock(&partitions[partitionNum].lock);
+  return;
+}
+
+/**
+ * Stores a copy of a pair's key, and the value, in its partition
+ */
+void AddPair(char *key, char *value) {
+  if (emitMode == MR_EMIT_LOCKFREE) {
+    struct keyVal rec;
+    SetKey(&rec, key);
+    rec.val = value;
+    EmitLockFree(&partitions[partitioner(key, NUM_PARTITIONS)], &rec);
+    return;
+  }
+  AddRecord(NewRecord(key, value));
+}
+
+/**
+ * Returns 1 in a map task attempt whose task another attempt has
+ * already committed. Its pairs are dropped and MR_Read() returns end of
+ * file, so a mapper that loops on either should stop early.
+ */
+int MR_Cancelled() {
+  struct mapTask *task = pthread_getspecific(taskKey);
+  return task != NULL && speculate &&
+      __atomic_load_n(&taskStates[task->file].committed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds bytes to the pairs held in task buffers, tracking the peak
+ */
+void AddBuffered(long bytes) {
+  long now = __atomic_add_fetch(&bufferedBytes, bytes, __ATOMIC_RELAXED);
+  long peak = __atomic_load_n(&stats.bufferPeak, __ATOMIC_RELAXED);
+  while (now > peak && !__atomic_compare_exchange_n(&stats.bufferPeak,
+          &peak, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/**
+ * Takes key-value pairs from various mappers,
+ * storing them in a partition so later reducers can access them
+ */
+void MR_Emit(char *key, char *value) {
+  if (strlen(key) == 0) {
+    return;
+  }
+  if (sampling) {
+    SampleEmit(key, value);
+    return;
+  }
+
+  // Attempts that already lost to another attempt drop their pairs
+  struct mapTask *task = pthread_getspecific(taskKey);
+  if (MR_Cancelled()) {
+    return;
+  }
+
+  // Buffered tasks add their pairs to the partitions when they finish
+  if (task != NULL) {
+    struct keyVal *new = NewRecord(key, value);
+    new->next = task->head;
+    task->head = new;
+    task->count++;
+    task->bytes += strlen(key) + strlen(value) + 2;
+    long footprint = sizeof(struct keyVal) + KeyHeapBytes(new->len) +
+        strlen(value) + 1;
+    task->footprint += footprint;
+    AddBuffered(footprint);
+    return;
+  }
+
+  AddPair(key, value);
+}
+
+/**
+ * Frees the buffered pairs of an attempt that lost
+ */
+void DiscardTask(struct mapTask *task) {
+  struct keyVal *iter = task->head;
+  while (iter != NULL) {
+    struct keyVal *temp = iter;
+    iter = iter->next;
+    FreeKey(temp);
+    free(temp);
+  }
+  task->head = NULL;
+  AddBuffered(-task->footprint);
+}
+
+/**
+ * Moves a finished task's buffered pairs into the partitions
+ */
+void CommitTask(struct mapTask *task) {
+  struct keyVal *iter = task->head;
+  while (iter != NULL) {
+    struct keyVal *temp = iter;
+    iter = iter->next;
+    AddRecord(temp);
+  }
+  task->head = NULL;
+  AddBuffered(-task->footprint);
+}
+
+/**
+ * FNV-1a hash of a file's contents, or 0 if it cannot be read
+ */
+unsigned long HashFile(char *file) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+
+  unsigned long hash = 14695981039346656037UL;
+  unsigned char buf[1 << 16];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      hash = (hash ^ buf[i]) * 1099511628211UL;
+    }
+  }
+  close(fd);
+  return n < 0 ? 0 : hash;
+}
+
+/**
+ * Returns the number of pairs in cached data, or -1 unless the data is
+ * exactly a sequence of non-empty keys and values, each NUL-terminated
+ */
+long CountCached(char *data, long bytes) {
+  char *iter = data;
+  char *end = data + bytes;
+  long count = 0;
+  while (iter < end) {
+    char *value = memchr(iter, '\0', end - iter);
+    if (value == NULL || value == iter) {
+      return -1;
+    }
+    value++;
+    char *next = value < end ? memchr(value, '\0', end - value) : NULL;
+    if (next == NULL) {
+      return -1;
+    }
+    iter = next + 1;
+    count++;
+  }
+  return count;
+}
+
+/**
+ * Reads the cached pairs of input file f, setting *count
+ * Returns NULL if there is no cache entry, the input or the mapper
+ * version has changed, or the entry is damaged
+ */
+char *ReadCache(int f, char *path, struct stat *st, long *count) {
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct cacheHeader hdr;
+  struct stat cst;
+  if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+          hdr.magic != CACHE_MAGIC || hdr.version != HashKey(cacheVersion) ||
+          hdr.size != st->st_size || fstat(fd, &cst) != 0 ||
+          hdr.bytes < 0 || hdr.bytes != cst.st_size - (off_t)sizeof(hdr)) {
+    close(fd);
+    return NULL;
+  }
+
+  // A changed identity (copied or touched file) only costs a hash check
+  if (hdr.dev != st->st_dev || hdr.ino != st->st_ino ||
+          hdr.mtimeSec != st->st_mtim.tv_sec ||
+          hdr.mtimeNsec != st->st_mtim.tv_nsec) {
+    if (HashFile(FILES[f]) != hdr.contentHash) {
+      close(fd);
+      return NULL;
+    }
+    hdr.dev = st->st_dev;
+    hdr.ino = st->st_ino;
+    hdr.mtimeSec = st->st_mtim.tv_sec;
+    hdr.mtimeNsec = st->st_mtim.tv_nsec;
+    // Refresh the identity so the next run can skip the hash
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+      // Harmless: the next run hashes the file again
+    }
+  }
+
+  char *data = malloc(hdr.bytes + 1);
+  if (pread(fd, data, hdr.bytes, sizeof(hdr)) != hdr.bytes) {
+    free(data);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  *count = CountCached(data, hdr.bytes);
+  if (*count < 0 || *count != hdr.count) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+/**
+ * Adds pairs read by ReadCache() to the partitions
+ * Values point into data, which is kept until MR_Run returns
+ */
+void AddCached(int f, char *data, long count) {
+  cacheData[f] = data;
+  char *iter = data;
+  for (long i = 0; i < count; i++) {
+    char *key = iter;
+    char *value = key + strlen(key) + 1;
+    iter = value + strlen(value) + 1;
+    AddPair(key, value);
+  }
+}
+
+/**
+ * Writes a finished task's pairs to the cache file at path
+ * The file is written under a temporary name and renamed into place,
+ * so an interrupted run never leaves a partial entry
+ */
+void SaveCache(char *file, char *path, struct stat *st,
+        struct mapTask *task) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.%lx", path, (unsigned long)pthread_self());
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    return;
+  }
+
+  struct cacheHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = CACHE_MAGIC;
+  hdr.version = HashKey(cacheVersion);
+  hdr.dev = st->st_dev;
+  hdr.ino = st->st_ino;
+  hdr.size = st->st_size;
+  hdr.mtimeSec = st->st_mtim.tv_sec;
+  hdr.mtimeNsec = st->st_mtim.tv_nsec;
+  hdr.contentHash = HashFile(file);
+  hdr.count = task->count;
+  hdr.bytes = task->bytes;
+
+  int ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+  for (struct keyVal *iter = task->head; ok && iter != NULL;
+          iter = iter->next) {
+    ok = fwrite(KeyOf(iter), iter->len + 1, 1, out) == 1 &&
+        fwrite(iter->val, strlen(iter->val) + 1, 1, out) == 1;
+  }
+  if (fclose(out) != 0 || !ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+  }
+}
+
+/**
+ * Seconds on the monotonic clock
+ */
+double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Claims task f for the calling attempt so only its pairs are kept
+ * Returns 0 if another attempt already finished the task
+ */
+int ClaimTask(int f, int attempt) {
+  if (!speculate) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&fileLock);
+  if (taskStates[f].committed) {
+    pthread_mutex_unlock(&fileLock);
+    return 0;
+  }
+  __atomic_store_n(&taskStates[f].committed, 1, __ATOMIC_RELAXED);
+
+  // Keep taskTimes sorted so PickStraggler reads the median directly
+  double t = Now() - taskStates[f].start;
+  int j = tasksDone++;
+  for (; j > 0 && taskTimes[j - 1] > t; j--) {
+    taskTimes[j] = taskTimes[j - 1];
+  }
+  taskTimes[j] = t;
+  if (attempt > 1) {
+    stats.specWins++;
+  }
+  pthread_mutex_unlock(&fileLock);
+  return 1;
+}
+
+/**
+ * Marks a claimed task's pairs as committed to the partitions
+ */
+void FinishTask() {
+  if (!speculate) {
+    return;
+  }
+  pthread_mutex_lock(&fileLock);
+  tasksLeft--;
+  pthread_cond_broadcast(&taskCond);
+  pthread_mutex_unlock(&fileLock);
+}
+
+/**
+ * Runs one attempt at mapping input file f
+ * In incremental mode the file's cached pairs are reused if it is
+ * unchanged, otherwise what it emits is cached. With caching or
+ * speculation the pairs are buffered until the attempt finishes.
+ */
+void RunTask(int f, int attempt) {
+  char *file = FILES[f];
+  char path[PATH_MAX];
+  struct stat st;
+  int caching = cacheDir != NULL && stat(file, &st) == 0;
+
+  if (caching) {
+    snprintf(path, sizeof(path), "%s/%016lx.mrc", cacheDir, HashKey(file));
+    long count;
+    char *data = attempt == 1 ? ReadCache(f, path, &st, &count) : NULL;
+    if (data != NULL) {
+      if (ClaimTask(f, attempt)) {
+        __atomic_fetch_add(&stats.cacheHits, 1, __ATOMIC_RELAXED);
+        AddCached(f, data, count);
+        FinishTask();
+      } else {
+        free(data);
+      }
+      return;
+    }
+    // A speculative duplicate is not another lookup
+    if (attempt == 1) {
+      __atomic_fetch_add(&stats.cacheMisses, 1, __ATOMIC_RELAXED);
+    }
+  } else if (!speculate) {
+    mapper(file);
+    return;
+  }
+
+  struct mapTask task;
+  memset(&task, 0, sizeof(task));
+  task.file = f;
+  pthread_setspecific(taskKey, &task);
+  mapper(file);
+  pthread_setspecific(taskKey, NULL);
+  CheckBudget();
+
+  if (!ClaimTask(f, attempt)) {
+    DiscardTask(&task);
+    return;
+  }
+  if (caching) {
+    SaveCache(file, path, &st, &task);
+  }
+  CommitTask(&task);
+  FinishTask();
+}
+
+/**
+ * Picks a running task to duplicate, or returns -1
+ * Only tasks with a single attempt that have run SPECULATE_FACTOR times
+ * longer than the median finished task qualify
+ * Caller holds fileLock
+ */
+int PickStraggler() {
+  if (tasksDone == 0 || 2 * tasksDone < NUM_FILES) {
+    return -1;
+  }
+
+  double limit = SPECULATE_FACTOR * taskTimes[tasksDone / 2];
+  if (limit < SPECULATE_MIN_SECONDS) {
+    limit = SPECULATE_MIN_SECONDS;
+  }
+
+  // Duplicate the task that has been running the longest
+  double now = Now();
+  int pick = -1;
+  for (int f = 0; f < currFile; f++) {
+    if (!taskStates[f].committed && taskStates[f].attempts == 1 &&
+            now - taskStates[f].start > limit &&
+            (pick < 0 || taskStates[f].start < taskStates[pick].start)) {
+      pick = f;
+    }
+  }
+  return pick;
+}
+
+/**
+ * Writes all n bytes of buf, retrying short writes
+ */
+void WriteAll(int fd, char *buf, size_t n) {
+  while (n > 0) {
+    ssize_t done = write(fd, buf, n);
+    if (done < 0) {
+      perror("MR_Output");
+      exit(1);
+    }
+    buf += done;
+    n -= done;
+  }
+}
+
+/**
+ * Appends n bytes to a partition's output file through its buffer
+ */
+void BufferOut(struct outWriter *out, void *data, size_t n) {
+  out->offset += n;
+  if (out->used + n > OUTPUT_BUFFER) {
+    WriteAll(out->fd, out->buf, out->used);
+    out->used = 0;
+  }
+
+  // Pieces too large for the buffer are written straight through
+  if (n > OUTPUT_BUFFER) {
+    WriteAll(out->fd, data, n);
+    return;
+  }
+  memcpy(out->buf + out->used, data, n);
+  out->used += n;
+}
+
+/**
+ * Compares a stored key of len bytes with a C string, like strcmp
+ */
+int CompareKey(unsigned char *stored, size_t len, char *key, size_t keyLen) {
+  int c = memcmp(stored, key, len < keyLen ? len : keyLen);
+  if (c != 0) {
+    return c;
+  }
+  return (len > keyLen) - (len < keyLen);
+}
+
+/**
+ * Writes the current data block and adds its index entry
+ */
+void FinishBlock(struct outWriter *out) {
+  struct tableBuilder *tb = out->table;
+  unsigned int numRestarts = (tb->blockCount + RESTART_INTERVAL - 1) /
+      RESTART_INTERVAL;
+
+  Reserve(&tb->block, &tb->blockCap,
+          tb->blockUsed + 4 * (numRestarts + 1));
+  memcpy(tb->block + tb->blockUsed, tb->restarts, 4 * numRestarts);
+  tb->blockUsed += 4 * numRestarts;
+  memcpy(tb->block + tb->blockUsed, &numRestarts, 4);
+  tb->blockUsed += 4;
+
+  Reserve(&tb->index, &tb->indexCap, tb->indexUsed + 30 + tb->lastLen);
+  PutVarint(tb->index, &tb->indexUsed, tb->lastLen);
+  memcpy(tb->index + tb->indexUsed, tb->lastKey, tb->lastLen);
+  tb->indexUsed += tb->lastLen;
+  PutVarint(tb->index, &tb->indexUsed, out->offset);
+  PutVarint(tb->index, &tb->indexUsed, tb->blockUsed);
+
+  BufferOut(out, tb->block, tb->blockUsed);
+  tb->blockUsed = 0;
+  tb->blockCount = 0;
+}
+
+/**
+ * Adds an entry to a partition's table
+ * Keys must arrive in sorted order; equal keys are kept in order
+ */
+void TableAdd(struct outWriter *out, char *key, char *value) {
+  struct tableBuilder *tb = out->table;
+  size_t keyLen = strlen(key);
+  size_t valLen = strlen(value);
+
+  if (tb->count > 0 && CompareKey((unsigned char *)tb->lastKey, tb->lastLen,
+          key, keyLen) > 0) {
+    fprintf(stderr, "MR_Output: table keys must be written in order\n");
+    exit(1);
+  }
+
+  size_t shared = 0;
+  if (tb->blockCount % RESTART_INTERVAL == 0) {
+    if (tb->blockCount % (RESTART_INTERVAL * 64) == 0) {
+      tb->restarts = realloc(tb->restarts, sizeof(unsigned int) *
+          (tb->blockCount / RESTART_INTERVAL + 64));
+    }
+    tb->restarts[tb->blockCount / RESTART_INTERVAL] = tb->blockUsed;
+  } else {
+    while (shared < keyLen && shared < tb->lastLen &&
+            tb->lastKey[shared] == key[shared]) {
+      shared++;
+    }
+  }
+
+  Reserve(&tb->block, &tb->blockCap,
+          tb->blockUsed + 30 + keyLen - shared + valLen + 1);
+  PutVarint(tb->block, &tb->blockUsed, shared);
+  PutVarint(tb->block, &tb->blockUsed, keyLen - shared);
+  PutVarint(tb->block, &tb->blockUsed, valLen);
+  memcpy(tb->block + tb->blockUsed, key + shared, keyLen - shared);
+  tb->blockUsed += keyLen - shared;
+  memcpy(tb->block + tb->blockUsed, value, valLen + 1);
+  tb->blockUsed += valLen + 1;
+  tb->blockCount++;
+
+  if (keyLen + 1 > tb->lastCap) {
+    tb->lastCap = (keyLen + 1) * 2;
+    tb->lastKey = realloc(tb->lastKey, tb->lastCap);
+  }
+  memcpy(tb->lastKey, key, keyLen + 1);
+  tb->lastLen = keyLen;
+
+  if (bloomBitsPerKey > 0) {
+    if ((tb->count & (tb->count - 1)) == 0) {
+      tb->hashes = realloc(tb->hashes,
+              sizeof(unsigned long) * (tb->count ? tb->count * 2 : 1));
+    }
+    tb->hashes[tb->count] = MixHash(HashKey(key));
+  }
+  tb->count++;
+
+  if (tb->blockUsed >= TABLE_BLOCK_SIZE) {
+    FinishBlock(out);
+  }
+}
+
+/**
+ * Writes the last block, the index, the Bloom filter and the footer
+ */
+void CloseTable(struct outWriter *out) {
+  struct tableBuilder *tb = out->table;
+  struct tableFooter footer;
+  memset(&footer, 0, sizeof(footer));
+
+  if (tb->blockCount > 0) {
+    FinishBlock(out);
+  }
+  footer.indexOff = out->offset;
+  footer.indexSize = tb->indexUsed;
+  BufferOut(out, tb->index, tb->indexUsed);
+
+  // k = bits per key * ln 2 probes minimizes the false positive rate
+  footer.bloomOff = out->offset;
+  if (bloomBitsPerKey > 0) {
+    unsigned long bits = tb->count * bloomBitsPerKey;
+    if (bits < 64) {
+      bits = 64;
+    }
+    footer.bloomSize = (bits + 7) / 8;
+    footer.bloomHashes = bloomBitsPerKey * 69 / 100;
+    if (footer.bloomHashes < 1) {
+      footer.bloomHashes = 1;
+    }
+    if (footer.bloomHashes > 30) {
+      footer.bloomHashes = 30;
+    }
+
+    unsigned char *bloom = calloc(footer.bloomSize, 1);
+    for (long i = 0; i < tb->count; i++) {
+      unsigned long h = tb->hashes[i];
+      unsigned long delta = (h >> 33) | (h << 31);
+      for (unsigned int j = 0; j < footer.bloomHashes; j++) {
+        unsigned long bit = h % (footer.bloomSize * 8);
+        bloom[bit / 8] |= 1 << (bit % 8);
+        h += delta;
+      }
+    }
+    BufferOut(out, bloom, footer.bloomSize);
+    free(bloom);
+  }
+  footer.count = tb->count;
+  footer.magic = TABLE_MAGIC;
+  BufferOut(out, &footer, sizeof(footer));
+
+  free(tb->block);
+  free(tb->restarts);
+  free(tb->lastKey);
+  free(tb->index);
+  free(tb->hashes);
+  free(tb);
+  out->table = NULL;
+}
+
+/**
+ * Writes a key and value to the calling reducer's partition file,
+ * <prefix>-NNNNN, as a "key value" line or a table entry. Output is
+ * buffered and written in large chunks. Each partition is reduced in
+ * strcmp order of its keys. MR_SortedPartition splits by the numeric
+ * value of atoi(key) instead, so the files concatenated in partition
+ * order are sorted only when the two orders agree: keys that are
+ * non-negative decimal integers below 2^31, zero-padded to one width.
+ */
+void MR_Output(char *key, char *value) {
+  int *part = pthread_getspecific(glob_var_key);
+  if (part == NULL) {
+    fprintf(stderr, "MR_Output: must be called from a reducer\n");
+    exit(1);
+  }
+  struct outWriter *out = &writers[*part];
+
+  if (out->buf == NULL) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s-%05d", outputPrefix, *part);
+    out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out->fd < 0) {
+      perror(path);
+      exit(1);
+    }
+    out->buf = malloc(OUTPUT_BUFFER);
+    __atomic_fetch_add(&stats.outputFiles, 1, __ATOMIC_RELAXED);
+    out->offset = 0;
+    if (outputFormat == MR_OUTPUT_TABLE) {
+      out->table = calloc(1, sizeof(struct tableBuilder));
+    }
+  }
+
+  if (out->table != NULL) {
+    TableAdd(out, key, value);
+    return;
+  }
+  BufferOut(out, key, strlen(key));
+  BufferOut(out, " ", 1);
+  BufferOut(out, value, strlen(value));
+  BufferOut(out, "\n", 1);
+}
+
+/**
+ * Flushes and closes a partition's output file, if it has one
+ */
+void CloseOutput(int partition_number) {
+  struct outWriter *out = &writers[partition_number];
+
+  if (out->buf == NULL) {
+    return;
+  }
+  if (out->table != NULL) {
+    CloseTable(out);
+  }
+  WriteAll(out->fd, out->buf, out->used);
+  close(out->fd);
+  free(out->buf);
+  out->buf = NULL;
+  out->used = 0;
+}
+
+/**
+ * Opens a table written with MR_OUTPUT_TABLE for lookups and scans
+ * Returns NULL if the file cannot be read or is not a table
+ */
+MR_Table *MR_TableOpen(char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct tableFooter)) {
+    close(fd);
+    return NULL;
+  }
+  unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  struct tableFooter footer;
+  memcpy(&footer, map + st.st_size - sizeof(footer), sizeof(footer));
+  unsigned long size = st.st_size;
+  if (footer.magic != TABLE_MAGIC || footer.indexOff > size ||
+          footer.indexSize > size - footer.indexOff ||
+          footer.bloomOff > size || footer.bloomSize > size - footer.bloomOff) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  MR_Table *table = calloc(1, sizeof(MR_Table));
+  table->map = map;
+  table->size = st.st_size;
+  table->bloom = map + footer.bloomOff;
+  table->bloomBits = footer.bloomSize * 8;
+  table->bloomHashes = footer.bloomHashes;
+
+  // Load the index: each block's last key, offset and size. Every field
+  // must lie within the index and every key and block within the file,
+  // and a block must hold its restart array, so lookups stay in the map.
+  long cap = 0;
+  size_t off = footer.indexOff;
+  size_t indexEnd = footer.indexOff + footer.indexSize;
+  while (off < indexEnd) {
+    if (table->numBlocks == cap) {
+      cap = cap ? cap * 2 : 64;
+      table->blockKeys = realloc(table->blockKeys, cap * sizeof(char *));
+      table->blockKeyLens = realloc(table->blockKeyLens,
+              cap * sizeof(size_t));
+      table->blockOffs = realloc(table->blockOffs,
+              cap * sizeof(unsigned long));
+      table->blockSizes = realloc(table->blockSizes,
+              cap * sizeof(unsigned long));
+    }
+    long b = table->numBlocks++;
+    size_t keyLen;
+    size_t blockOff;
+    size_t blockSize;
+    unsigned int numRestarts;
+    if (!GetVarintBounded(map, &off, indexEnd, &keyLen) ||
+            keyLen > indexEnd - off) {
+      MR_TableClose(table);
+      return NULL;
+    }
+    table->blockKeyLens[b] = keyLen;
+    table->blockKeys[b] = map + off;
+    off += keyLen;
+    if (!GetVarintBounded(map, &off, indexEnd, &blockOff) ||
+            !GetVarintBounded(map, &off, indexEnd, &blockSize) ||
+            blockOff > size || blockSize > size - blockOff || blockSize < 4) {
+      MR_TableClose(table);
+      return NULL;
+    }
+    table->blockOffs[b] = blockOff;
+    table->blockSizes[b] = blockSize;
+    memcpy(&numRestarts, map + blockOff + blockSize - 4, 4);
+    if (numRestarts == 0 || numRestarts > blockSize / 4 - 1) {
+      MR_TableClose(table);
+      return NULL;
+    }
+  }
+  return table;
+}
+
+/**
+ * Unmaps a table and frees its index
+ */
+void MR_TableClose(MR_Table *table) {
+  munmap(table->map, table->size);
+  free(table->blockKeys);
+  free(table->blockKeyLens);
+  free(table->blockOffs);
+  free(table->blockSizes);
+  free(table->key);
+  free(table);
+}
+
+/**
+ * Returns the first block whose last key is not less than key,
+ * or numBlocks if every key in the table is smaller
+ */
+long FindBlock(MR_Table *table, char *key, size_t keyLen) {
+  long lo = 0;
+  long hi = table->numBlocks;
+  while (lo < hi) {
+    long mid = (lo + hi) / 2;
+    if (CompareKey(table->blockKeys[mid], table->blockKeyLens[mid],
+            key, keyLen) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/**
+ * Decodes the entry at *off in a block into table->key, returning its
+ * value and advancing *off past the entry
+ */
+char *NextEntry(MR_Table *table, unsigned char *block, size_t *off,
+        size_t *keyLen) {
+  size_t shared = GetVarint(block, off);
+  size_t unshared = GetVarint(block, off);
+  size_t valLen = GetVarint(block, off);
+
+  if (shared + unshared + 1 > table->keyCap) {
+    table->keyCap = (shared + unshared + 1) * 2;
+    table->key = realloc(table->key, table->keyCap);
+  }
+  memcpy(table->key + shared, block + *off, unshared);
+  *keyLen = shared + unshared;
+  table->key[*keyLen] = '\0';
+  *off += unshared;
+
+  char *value = (char *)block + *off;
+  *off += valLen + 1;
+  return value;
+}
+
+/**
+ * Returns the offset of the last restart entry in block b whose key is
+ * less than key, or 0, so a scan from there finds the first match.
+ * Sets *end to the end of the block's entries.
+ */
+size_t SeekBlock(MR_Table *table, long b, char *key, size_t *end) {
+  unsigned char *block = table->map + table->blockOffs[b];
+  unsigned int numRestarts;
+  memcpy(&numRestarts, block + table->blockSizes[b] - 4, 4);
+  *end = table->blockSizes[b] - 4 * (numRestarts + 1);
+  if (key == NULL) {
+    return 0;
+  }
+
+  // Restart entries hold their whole key, so they compare in place
+  size_t keyLen = strlen(key);
+  long lo = 0;
+  long hi = numRestarts;
+  while (hi - lo > 1) {
+    long mid = (lo + hi) / 2;
+    unsigned int restart;
+    memcpy(&restart, block + *end + 4 * mid, 4);
+    size_t off = restart;
+    GetVarint(block, &off);
+    size_t len = GetVarint(block, &off);
+    GetVarint(block, &off);
+    if (CompareKey(block + off, len, key, keyLen) < 0) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  unsigned int restart;
+  memcpy(&restart, block + *end + 4 * lo, 4);
+  return restart;
+}
+
+/**
+ * Returns the value of the first entry with the given key, or NULL
+ * The value points into the mapped table and lives until MR_TableClose()
+ */
+char *MR_TableGet(MR_Table *table, char *key) {
+  size_t keyLen = strlen(key);
+
+  if (table->bloomBits > 0) {
+    unsigned long h = MixHash(HashKey(key));
+    unsigned long delta = (h >> 33) | (h << 31);
+    for (unsigned int j = 0; j < table->bloomHashes; j++) {
+      unsigned long bit = h % table->bloomBits;
+      if ((table->bloom[bit / 8] & (1 << (bit % 8))) == 0) {
+        return NULL;
+      }
+      h += delta;
+    }
+  }
+
+  long b = FindBlock(table, key, keyLen);
+  if (b == table->numBlocks) {
+    return NULL;
+  }
+
+  size_t end;
+  size_t off = SeekBlock(table, b, key, &end);
+  unsigned char *block = table->map + table->blockOffs[b];
+  while (off < end) {
+    size_t len;
+    char *value = NextEntry(table, block, &off, &len);
+    int c = CompareKey((unsigned char *)table->key, len, key, keyLen);
+    if (c == 0) {
+      return value;
+    }
+    if (c > 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Calls visit on every entry with start <= key < end, in key order
+ * A NULL start or end leaves that side of the range open
+ */
+void MR_TableScan(MR_Table *table, char *start, char *end, Visitor visit) {
+  long b = start ? FindBlock(table, start, strlen(start)) : 0;
+
+  for (; b < table->numBlocks; b++) {
+    size_t blockEnd;
+    size_t off = SeekBlock(table, b, start, &blockEnd);
+    unsigned char *block = table->map + table->blockOffs[b];
+    while (off < blockEnd) {
+      size_t len;
+      char *value = NextEntry(table, block, &off, &len);
+      if (start != NULL && strcmp(table->key, start) < 0) {
+        continue;
+      }
+      if (end != NULL && strcmp(table->key, end) >= 0) {
+        return;
+      }
+      visit(table->key, value);
+    }
+    // Only the first block can hold keys before start
+    start = NULL;
+  }
+}
+
+/**
+ * Asks the kernel to start reading a whole file into the page cache
+ * Pipes and devices are left alone: opening a FIFO would block, and
+ * closing it could make its writer fail
+ */
+void PrefetchFile(char *file) {
+  struct stat st;
+  if (stat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return;
+  }
+  int fd = open(file, O_RDONLY | O_NONBLOCK);
+  if (fd < 0) {
+    return;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
+/**
+ * Helper thread that keeps the next prefetchDepth queued files
+ * read ahead of the mappers, so opens and cold reads overlap mapping
+ */
+void *prefetching() {
+  pthread_mutex_lock(&fileLock);
+  while (1) {
+    // Files already taken by a mapper are not worth prefetching
+    if (prefetched < currFile) {
+      prefetched = currFile;
+    }
+    if (NUM_FILES <= prefetched) {
+      break;
+    }
+    if (currFile + prefetchDepth <= prefetched) {
+      pthread_cond_wait(&prefetchCond, &fileLock);
+      continue;
+    }
+
+    char *file = FILES[prefetched];
+    prefetched++;
+    pthread_mutex_unlock(&fileLock);
+    PrefetchFile(file);
+    pthread_mutex_lock(&fileLock);
+  }
+  pthread_mutex_unlock(&fileLock);
+  return NULL;
+}
+
+/**
+ * Switches from the running coroutine mapper back to its worker
+ * The coroutine's map task is saved across the switch, since the
+ * worker runs other coroutines' tasks in between
+ */
+void Yield(int state, int fd) {
+  struct coWorker *worker = pthread_getspecific(coKey);
+  struct coroutine *co = worker->current;
+  void *task = pthread_getspecific(taskKey);
+
+  co->state = state;
+  co->waitFd = fd;
+  __atomic_fetch_add(&stats.coSwitches, 1, __ATOMIC_RELAXED);
+  swapcontext(&co->ctx, &worker->sched);
+  pthread_setspecific(taskKey, task);
+}
+
+/**
+ * Reads like read(), for use by mappers
+ * In a coroutine, a read that would block on an empty pipe or socket
+ * parks the coroutine until fd is readable. A regular file read that
+ * misses the page cache starts readahead and lets the other coroutines
+ * run once before reading, and blocking if the data is still not in.
+ * An attempt that has lost to another attempt reads end of file.
+ */
+ssize_t MR_Read(int fd, void *buf, size_t count) {
+  if (MR_Cancelled()) {
+    return 0;
+  }
+  if (pthread_getspecific(coKey) == NULL) {
+    return read(fd, buf, count);
+  }
+
+  struct iovec iov = { buf, count };
+  int missed = 0;
+  while (1) {
+    ssize_t n = preadv2(fd, &iov, 1, -1, RWF_NOWAIT);
+    if (n >= 0 || (errno != EAGAIN && errno != EOPNOTSUPP)) {
+      return n;
+    }
+
+    // Regular files always poll readable, so not readable means a pipe
+    struct pollfd p = { fd, POLLIN, 0 };
+    int err = errno;
+    if (poll(&p, 1, 0) == 0) {
+      Yield(CO_WAITING, fd);
+      continue;
+    }
+    if (err == EOPNOTSUPP || missed) {
+      return read(fd, buf, count);
+    }
+
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos >= 0) {
+      posix_fadvise(fd, pos, count, POSIX_FADV_WILLNEED);
+    }
+    missed = 1;
+    Yield(CO_READY, -1);
+  }
+}
+
+/**
+ * Waits up to 10ms for a map task to be committed
+ * A coroutine gives its worker to the other coroutines instead
+ * Caller holds fileLock
+ */
+void WaitForTasks() {
+  if (pthread_getspecific(coKey) != NULL) {
+    pthread_mutex_unlock(&fileLock);
+    Yield(CO_IDLE, -1);
+    pthread_mutex_lock(&fileLock);
+    return;
+  }
+
+  struct timespec wake;
+  clock_gettime(CLOCK_REALTIME, &wake);
+  wake.tv_nsec += 10 * 1000 * 1000;
+  if (wake.tv_nsec >= 1000 * 1000 * 1000) {
+    wake.tv_sec++;
+    wake.tv_nsec -= 1000 * 1000 * 1000;
+  }
+  pthread_cond_timedwait(&taskCond, &fileLock, &wake);
+}
+
+/**
+ * Helper function that calls the mapper,
+ * assigning files to mapper threads
+ */
+void *mapping() {
+  pthread_mutex_lock(&fileLock);
+  while (1) {
+    int f;
+
+    if (currFile < NUM_FILES) {
+      f = currFile;
+      currFile++;
+      taskStates[f].start = Now();
+      taskStates[f].attempts = 1;
+      pthread_cond_signal(&prefetchCond);
+
+      pthread_mutex_unlock(&fileLock);
+      RunTask(f, 1);
+      CheckBudget();
+      pthread_mutex_lock(&fileLock);
+      continue;
+    }
+
+    // Queue is empty: look for a straggler until every task is committed
+    if (!speculate || tasksLeft == 0) {
+      break;
+    }
+    f = PickStraggler();
+    if (f >= 0) {
+      int attempt = ++taskStates[f].attempts;
+      stats.specAttempts++;
+      pthread_mutex_unlock(&fileLock);
+      RunTask(f, attempt);
+      pthread_mutex_lock(&fileLock);
+      continue;
+    }
+    WaitForTasks();
+  }
+  pthread_mutex_unlock(&fileLock);
+  return NULL;
+}
+
+/**
+ * Entry point of a coroutine mapper
+ */
+void CoroutineMain() {
+  struct coWorker *worker = pthread_getspecific(coKey);
+  mapping();
+  worker->current->state = CO_DONE;
+}
+
+/**
+ * Maps a coroutine stack with a PROT_NONE guard page below it
+ * Pages are only backed once touched, so unused stack costs nothing
+ */
+char *NewStack() {
+  long page = sysconf(_SC_PAGESIZE);
+  char *stack = mmap(NULL, COROUTINE_STACK + page, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED || mprotect(stack, page, PROT_NONE) != 0) {
+    perror("coroutine stack");
+    exit(1);
+  }
+  return stack + page;
+}
+
+/**
+ * Unmaps a stack made by NewStack(), guard page included
+ */
+void FreeStack(char *stack) {
+  long page = sysconf(_SC_PAGESIZE);
+  munmap(stack - page, COROUTINE_STACK + page);
+}
+
+/**
+ * Worker thread that runs its coroutine mappers round robin
+ * When none of them can make progress it sleeps in poll() until a
+ * descriptor one is waiting on is readable, or for 10ms if some are
+ * only waiting for other tasks to be committed
+ */
+void *coWorking(void *arg) {
+  struct coWorker *worker = arg;
+  pthread_setspecific(coKey, worker);
+  StartCounters(PHASE_MAP, 0);
+
+  for (int i = 0; i < worker->count; i++) {
+    struct coroutine *co = &worker->cos[i];
+    co->stack = NewStack();
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = COROUTINE_STACK;
+    co->ctx.uc_link = &worker->sched;
+    makecontext(&co->ctx, CoroutineMain, 0);
+  }
+
+  int live = worker->count;
+  struct pollfd fds[worker->count];
+  while (live > 0) {
+    int progress = 0;
+    int idle = 0;
+    for (int i = 0; i < worker->count; i++) {
+      struct coroutine *co = &worker->cos[i];
+      if (co->state == CO_WAITING || co->state == CO_DONE) {
+        continue;
+      }
+      worker->current = co;
+      swapcontext(&worker->sched, &co->ctx);
+      worker->current = NULL;
+      pthread_setspecific(taskKey, NULL);
+
+      if (co->state == CO_DONE) {
+        FreeStack(co->stack);
+        live--;
+      }
+      if (co->state == CO_IDLE) {
+        idle = 1;
+      } else {
+        progress = 1;
+      }
+    }
+
+    // Wake coroutines whose descriptors became readable
+    int n = 0;
+    for (int i = 0; i < worker->count; i++) {
+      if (worker->cos[i].state == CO_WAITING) {
+        fds[n].fd = worker->cos[i].waitFd;
+        fds[n].events = POLLIN;
+        n++;
+      }
+    }
+    if (n == 0 && (progress || !idle)) {
+      continue;
+    }
+    if (poll(fds, n, progress ? 0 : idle ? 10 : -1) <= 0) {
+      continue;
+    }
+    n = 0;
+    for (int i = 0; i < worker->count; i++) {
+      if (worker->cos[i].state == CO_WAITING) {
+        if (fds[n].revents != 0) {
+          worker->cos[i].state = CO_READY;
+        }
+        n++;
+      }
+    }
+  }
+  StopCounters();
+  return NULL;
+}
+
+/**
+ * Mapper thread: maps input files until every task is done
+ */
+void *mapThread() {
+  StartCounters(PHASE_MAP, 0);
+  mapping();
+  StopCounters();
+  return NULL;
+}
+
+/**
+ * Helper function that calls the reducer,
+ * assigning partitions to reducer threads
+ * Once no partitions are left, the thread helps sort the remaining ones
+ */
+void *reduction() {
+  StartCounters(PHASE_SORT, 1);
+  while (1) {
+    pthread_mutex_lock(&fileLock);
+    if (NUM_PARTITIONS <= nextPart) {
+      pthread_mutex_unlock(&fileLock);
+      SwitchPhase(PHASE_SORT);
+      HelpSort();
+      StopCounters();
+      return NULL;
+    }
+
+    int *part = malloc(sizeof(int));
+    *part = nextPart;
+    pthread_setspecific(glob_var_key, part);
+    nextPart++;
+    pthread_mutex_unlock(&fileLock);
+
+    int *glob_spec_var = pthread_getspecific(glob_var_key);
+    struct fcRun *run = &runs[*glob_spec_var];
+    SwitchPhase(PHASE_SORT);
+    if (emitMode == MR_EMIT_LOCKFREE) {
+      LinkChunks(&partitions[*glob_spec_var]);
+    }
+    ParallelSort(&partitions[*glob_spec_var].head,
+            partitions[*glob_spec_var].count);
+    EncodeRun(run, partitions[*glob_spec_var].head);
+    partitions[*glob_spec_var].head = NULL;
+    FreeChunks(&partitions[*glob_spec_var]);
+
+    SwitchPhase(PHASE_REDUCE);
+    while (run->pos < run->count) {
+      DecodeKey(run);
+      run->groupDone = 0;
+      reducer(run->key, get_next, *glob_spec_var);
+      partitions[*glob_spec_var].keys++;
+
+      // Skip any values the reducer left unread
+      while (get_next(run->key, *glob_spec_var) != NULL) {
+      }
+    }
+    CloseOutput(*glob_spec_var);
+    free(part);
+  }
+}
+
+/**
+ * Creates threads and runs the computation
+ */
+void MR_Run(int argc, char *argv[], Mapper map, int num_mappers,
+Reducer reduce, int num_reducers, Partitioner partition, int num_partitions) {
+  // Exit if there is no file specified
+  if (argc < 2) {
+    printf("No file specified\n");
+    exit(0);
+  }
+
+  // The sampling pass runs the mapper, so the thread keys MR_Emit and
+  // MR_Read look up and the join table it probes come first
+  pthread_key_create(&taskKey, NULL);
+  pthread_key_create(&coKey, NULL);
+  pthread_key_create(&counterKey, NULL);
+
+  // Load the small side of a map-side join
+  if (joinLoader != NULL) {
+    joinLoader(joinFile);
+  }
+
+  // Pick any counts left to MR_AUTO
+  memset(&stats, 0, sizeof(stats));
+  mapper = map;
+  ChooseCounts(argc, argv, &num_mappers, &num_reducers, &num_partitions);
+
+  // Inititalize global variables
+  initialize(argc, argv, map, num_mappers, reduce,
+          num_reducers, partition, num_partitions);
+
+  if (cacheDir != NULL && mkdir(cacheDir, 0755) != 0 && errno != EEXIST) {
+    perror(cacheDir);
+    exit(1);
+  }
+
+  // Start reading queued files ahead of the mappers
+  pthread_t prefetcher;
+  pthread_cond_init(&prefetchCond, NULL);
+  pthread_cond_init(&taskCond, NULL);
+  if (prefetchDepth > 0) {
+    pthread_create(&prefetcher, NULL, prefetching, NULL);
+  }
+
+  // Create mapper threads, or for coroutine mappers one worker thread
+  // per core, each running an even share of the coroutines
+  int kMapThreads = num_mappers < NUM_FILES ? num_mappers : NUM_FILES;
+  struct coroutine *coroutines = NULL;
+  struct coWorker *coWorkers = NULL;
+  if (mapMode == MR_MAP_COROUTINES) {
+    int numCoroutines = kMapThreads;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+      cores = 1;
+    }
+    if (cores < kMapThreads) {
+      kMapThreads = cores;
+    }
+    coroutines = calloc(numCoroutines, sizeof(struct coroutine));
+    coWorkers = calloc(kMapThreads, sizeof(struct coWorker));
+    struct coroutine *next = coroutines;
+    for (int i = 0; i < kMapThreads; i++) {
+      coWorkers[i].cos = next;
+      coWorkers[i].count = numCoroutines / kMapThreads +
+          (i < numCoroutines % kMapThreads);
+      next += coWorkers[i].count;
+    }
+    stats.coWorkers = kMapThreads;
+  }
+  pthread_t mappers[kMapThreads];
+  for (int i = 0; i < kMapThreads; i++) {
+    if (coWorkers != NULL) {
+      pthread_create(&mappers[i], NULL, coWorking, &coWorkers[i]);
+    } else {
+      pthread_create(&mappers[i], NULL, mapThread, NULL);
+    }
+  }
+  // Join mapper threads
+  // With speculation, reducing starts once every task is committed;
+  // attempts that lost may still be running and are joined at the end
+  if (speculate) {
+    pthread_mutex_lock(&fileLock);
+    while (tasksLeft > 0) {
+      pthread_cond_wait(&taskCond, &fileLock);
+    }
+    pthread_mutex_unlock(&fileLock);
+  } else {
+    for (int i = 0; i < kMapThreads; i++) {
+      pthread_join(mappers[i], NULL);
+    }
+  }
+  if (prefetchDepth > 0) {
+    pthread_join(prefetcher, NULL);
+  }
+  pthread_cond_destroy(&prefetchCond);
+
+  // Every pair is in a partition now, so this is the footprint's peak
+  stats.pairBytes = TotalPairBytes();
+  CheckBudget();
+
+  // Create reducer threads
+  int kRedThreads = num_reducers;
+  pthread_t reducers[kRedThreads];
+  pthread_key_create(&glob_var_key, NULL);
+  pthread_mutex_init(&sortLock, NULL);
+  pthread_cond_init(&sortCond, NULL);
+  busyReducers = num_reducers;
+  // Threads beyond the number of partitions help with parallel sorts
+  for (int i = 0; i < num_reducers; i++) {
+    pthread_create(&reducers[i], NULL, reduction, NULL);
+  }
+  // Join reducer threads
+  for (int i = 0; i < num_reducers; i++) {
+    pthread_join(reducers[i], NULL);
+  }
+  pthread_cond_destroy(&sortCond);
+  pthread_mutex_destroy(&sortLock);
+
+  if (speculate) {
+    for (int i = 0; i < kMapThreads; i++) {
+      pthread_join(mappers[i], NULL);
+    }
+  }
+  pthread_cond_destroy(&taskCond);
+  free(coWorkers);
+  free(coroutines);
+
+  // Free encoded runs
+  for (int i = 0; i < NUM_PARTITIONS; i++) {
+    stats.runBytes += runs[i].cap + runs[i].count * sizeof(char *);
+    free(runs[i].data);
+    free(runs[i].vals);
+    free(runs[i].key);
+    pthread_mutex_destroy(&partitions[i].lock);
+  }
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    stats.peakRss = usage.ru_maxrss * 1024L;
   }
+  PrintStats();
+  FreeCounters();
 
   // Free structs
-  free(backups);
+  for (int i = 0; i < NUM_FILES; i++) {
+    free(cacheData[i]);
+  }
+  free(cacheData);
+  free(taskStates);
+  free(taskTimes);
+  pthread_key_delete(taskKey);
+  pthread_key_delete(coKey);
+  pthread_key_delete(counterKey);
+  FreeJoinTable();
+  free(runs);
+  free(writers);
   free(partitions);
-  free(nextKey);
 }
@@ -1,17 +1,45 @@
 #ifndef __mapreduce_h__
 #define __mapreduce_h__
 
+#include <stdio.h>
+#include <sys/types.h>
+
 // Different function pointer types used by MR
 typedef char *(*Getter)(char *key, int partition_number);
 typedef void (*Mapper)(char *file_name);
 typedef void (*Reducer)(char *key, Getter get_func, int partition_number);
 typedef unsigned long (*Partitioner)(char *key, int num_partitions);
+typedef void (*Visitor)(char *key, char *value);
+
+// Pass as num_mappers, num_reducers or num_partitions to have MR_Run
+// pick the count from the core count and input size. It is 0, so a
+// count of 0 means auto, not none.
+#define MR_AUTO 0
+
+// Formats for MR_SetOutputFormat()
+#define MR_OUTPUT_TEXT  0  // "key value" lines (default)
+#define MR_OUTPUT_TABLE 1  // Sorted table with a block index, see MR_Table
+
+// Emit paths for MR_SetEmitMode()
+#define MR_EMIT_LOCKED   0  // Partition mutex (default)
+#define MR_EMIT_LOCKFREE 1  // CAS-pushed record chunks, no partition lock
+
+// Execution models for MR_SetMapMode()
+#define MR_MAP_THREADS    0  // One thread per mapper (default)
+#define MR_MAP_COROUTINES 1  // Mappers are coroutines over one thread per core
 
 // External functions: these are what *you must implement*
 void MR_Emit(char *key, char *value);
 
+// Called from a reducer: buffered write to that partition's output file
+void MR_Output(char *key, char *value);
+
 unsigned long MR_DefaultHashPartition(char *key, int num_partitions);
 
+// Splits keys by the value of atoi(key), while each partition is reduced
+// in strcmp order. Output files concatenated in partition order are sorted
+// only when the two agree: non-negative decimal integers below 2^31,
+// zero-padded to one width.
 unsigned long MR_SortedPartition(char *key, int num_partitions);
 
 void MR_Run(int argc, char *argv[], 
@@ -19,4 +47,70 @@ void MR_Run(int argc, char *argv[],
 	    Reducer reduce, int num_reducers, 
 	    Partitioner partition, int num_partitions);
 
+// Optional settings: call these before MR_Run()
+void MR_SetEmitMode(int mode);
+
+void MR_SetOutput(char *prefix);
+
+void MR_SetOutputFormat(int format, int bloom_bits_per_key);
+
+void MR_SetPrefetchDepth(int depth);
+
+// With MR_MAP_COROUTINES, num_mappers coroutines share a worker thread per
+// core; a mapper reading through MR_Read() lets the others run while it
+// waits for data. MR_Read() behaves like read() in either mode.
+void MR_SetMapMode(int mode);
+
+ssize_t MR_Read(int fd, void *buf, size_t count);
+
+// Map-side join: load(file_name) runs once before mapping and fills a
+// shared read-only table with MR_JoinPut(); mappers probe it directly
+void MR_SetJoinTable(char *file_name, Mapper load);
+
+void MR_JoinPut(char *key, char *value);
+
+char *MR_JoinGet(char *key);
+
+// Tuning for MR_AUTO, and a stream for the end-of-run statistics
+void MR_SetTargetPartitionSize(long bytes);
+
+void MR_SetAutoSample(int enable);
+
+void MR_SetStats(FILE *out);
+
+// Bytes of intermediate pairs a job should stay within. MR_AUTO sizes
+// partitions to fit, and MR_Run warns on stderr once pairs exceed it.
+void MR_SetMemoryBudget(long bytes);
+
+// Performance counters per phase and per thread, printed with the stats
+void MR_SetCounters(int enable);
+
+// Incremental mode: map output of unchanged input files is reused, if it
+// was cached under the same mapper version
+void MR_SetCacheDir(char *dir, char *version);
+
+// Duplicate straggling map tasks on idle mappers; first to finish wins
+void MR_SetSpeculation(int enable);
+
+// Called from a mapper: 1 once another attempt at its task has won. The
+// attempt's MR_Emit() calls are dropped and MR_Read() returns 0, so a
+// mapper should stop on either; MR_Run waits for every attempt to return.
+int MR_Cancelled(void);
+
+// Partition access that is safe while mappers are running
+long MR_PartitionCount(int partition_number);
+
+void MR_PartitionScan(int partition_number, Visitor visit);
+
+// Reader for MR_OUTPUT_TABLE files: point lookups and key range scans
+typedef struct MR_Table MR_Table;
+
+MR_Table *MR_TableOpen(char *path);
+
+char *MR_TableGet(MR_Table *table, char *key);
+
+void MR_TableScan(MR_Table *table, char *start, char *end, Visitor visit);
+
+void MR_TableClose(MR_Table *table);
+
 #endif // __mapreduce_h__
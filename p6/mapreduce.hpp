@@ -0,0 +1,227 @@
+#ifndef __mapreduce_hpp__
+#define __mapreduce_hpp__
+
+// Typed MapReduce front-end. Keys, values, the partition hash and the key
+// ordering are template parameters, so emits, sorts and key grouping are
+// compiled for each job and the comparator is inlined into the sort.
+//
+// This is a separate in-memory runtime on std::thread, not a wrapper of
+// MR_Run: the C runtime orders keys with strcmp and would lose the typed
+// comparator. It shares only MR_AUTO and the partition functions, so
+// none of the C runtime's features apply to it: the MR_Set* options,
+// MR_Output, table output, the cache, speculation and the stats.
+//
+// MR_AUTO is 0, so a count of 0 means auto, not none. Auto counts come
+// from the core count alone: a mapper per core (at most one per file),
+// a reducer per core and a partition per reducer. See wordcount.cpp for
+// a complete job.
+//
+// Example:
+//   mr::MapReduce<std::string, long> job(4, 4, 16);
+//   job.Run(argc, argv,
+//       [](const char *file, auto &emit) { ... emit(word, 1L); },
+//       [](const std::string &key, auto values, int partition) { ... });
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "mapreduce.h"
+}
+
+namespace mr {
+
+// Partition hash used when none is given: std::hash modulo the count
+template <typename K>
+struct DefaultHash {
+  unsigned long operator()(const K &key, int num_partitions) const {
+    return std::hash<K>()(key) % num_partitions;
+  }
+};
+
+// String keys land in the same partitions as they would in the C runtime
+template <>
+struct DefaultHash<std::string> {
+  unsigned long operator()(const std::string &key, int num_partitions) const {
+    return MR_DefaultHashPartition(const_cast<char *>(key.c_str()),
+                                   num_partitions);
+  }
+};
+
+// Adapts a C Partitioner, e.g. CPartition<MR_SortedPartition>
+template <Partitioner P>
+struct CPartition {
+  unsigned long operator()(const std::string &key, int num_partitions) const {
+    return P(const_cast<char *>(key.c_str()), num_partitions);
+  }
+};
+
+template <typename K, typename V, typename Hash = DefaultHash<K>,
+          typename Less = std::less<K>>
+class MapReduce {
+ public:
+  typedef std::pair<K, V> Pair;
+
+  // Per-mapper emit buffers, one vector per partition, so emits never lock
+  class Emitter {
+   public:
+    Emitter(const Hash &hash, int num_partitions)
+        : hash_(hash), buckets_(num_partitions) {}
+
+    void operator()(K key, V value) {
+      unsigned long n = hash_(key, (int)buckets_.size());
+      buckets_[n].emplace_back(std::move(key), std::move(value));
+    }
+
+   private:
+    friend class MapReduce;
+    Hash hash_;
+    std::vector<std::vector<Pair>> buckets_;
+  };
+
+  // Iterates over the values of one key
+  class ValueIterator {
+   public:
+    explicit ValueIterator(const Pair *pos) : pos_(pos) {}
+    const V &operator*() const { return pos_->second; }
+    ValueIterator &operator++() {
+      ++pos_;
+      return *this;
+    }
+    bool operator!=(const ValueIterator &other) const {
+      return pos_ != other.pos_;
+    }
+
+   private:
+    const Pair *pos_;
+  };
+
+  // The values of one key, passed to the reducer
+  class Values {
+   public:
+    Values(const Pair *first, const Pair *last) : first_(first), last_(last) {}
+    ValueIterator begin() const { return ValueIterator(first_); }
+    ValueIterator end() const { return ValueIterator(last_); }
+    size_t size() const { return last_ - first_; }
+
+   private:
+    const Pair *first_;
+    const Pair *last_;
+  };
+
+  // Any count may be MR_AUTO (0); negative counts throw std::invalid_argument
+  MapReduce(int num_mappers, int num_reducers, int num_partitions,
+            Hash hash = Hash(), Less less = Less())
+      : num_mappers_(num_mappers), num_reducers_(num_reducers),
+        num_partitions_(num_partitions), hash_(hash), less_(less) {
+    if (num_mappers < 0 || num_reducers < 0 || num_partitions < 0) {
+      throw std::invalid_argument("mr::MapReduce: negative count");
+    }
+  }
+
+  // Same arguments as MR_Run: the input files are argv[1..argc-1]
+  template <typename MapFn, typename ReduceFn>
+  void Run(int argc, char *argv[], MapFn map, ReduceFn reduce) {
+    Run(std::vector<std::string>(argv + 1, argv + argc), map, reduce);
+  }
+
+  // map(const char *file, Emitter &emit)
+  // reduce(const K &key, Values values, int partition_number)
+  template <typename MapFn, typename ReduceFn>
+  void Run(const std::vector<std::string> &files, MapFn map,
+           ReduceFn reduce) {
+    int cores = std::max(1, (int)std::thread::hardware_concurrency());
+    int num_mappers = num_mappers_;
+    if (num_mappers == MR_AUTO) {
+      num_mappers = std::max(1, std::min(cores, (int)files.size()));
+    }
+    int num_reducers = num_reducers_ == MR_AUTO ? cores : num_reducers_;
+    int num_partitions =
+        num_partitions_ == MR_AUTO ? num_reducers : num_partitions_;
+
+    std::vector<Emitter> emitters(num_mappers,
+                                  Emitter(hash_, num_partitions));
+    std::atomic<size_t> nextFile(0);
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < num_mappers; i++) {
+      threads.emplace_back([&, i] {
+        size_t f;
+        while ((f = nextFile++) < files.size()) {
+          map(files[f].c_str(), emitters[i]);
+        }
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    threads.clear();
+
+    std::atomic<int> nextPart(0);
+    for (int i = 0; i < num_reducers; i++) {
+      threads.emplace_back([&] {
+        int p;
+        while ((p = nextPart++) < num_partitions) {
+          ReducePartition(p, emitters, reduce);
+        }
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+  }
+
+ private:
+  // Gathers a partition from every mapper's buffer, sorts it and
+  // calls reduce once per group of equal keys
+  template <typename ReduceFn>
+  void ReducePartition(int p, std::vector<Emitter> &emitters,
+                       ReduceFn &reduce) {
+    size_t total = 0;
+    for (auto &e : emitters) {
+      total += e.buckets_[p].size();
+    }
+
+    std::vector<Pair> pairs;
+    pairs.reserve(total);
+    for (auto &e : emitters) {
+      auto &bucket = e.buckets_[p];
+      std::move(bucket.begin(), bucket.end(), std::back_inserter(pairs));
+      std::vector<Pair>().swap(bucket);
+    }
+
+    const Less &less = less_;
+    std::stable_sort(pairs.begin(), pairs.end(),
+                     [&less](const Pair &a, const Pair &b) {
+                       return less(a.first, b.first);
+                     });
+
+    const Pair *data = pairs.data();
+    size_t i = 0;
+    while (i < pairs.size()) {
+      size_t j = i + 1;
+      while (j < pairs.size() && !less(data[i].first, data[j].first)) {
+        j++;
+      }
+      reduce(data[i].first, Values(data + i, data + j), p);
+      i = j;
+    }
+  }
+
+  int num_mappers_;
+  int num_reducers_;
+  int num_partitions_;
+  Hash hash_;
+  Less less_;
+};
+
+}  // namespace mr
+
+#endif  // __mapreduce_hpp__
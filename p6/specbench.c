@@ -0,0 +1,132 @@
+/**
+ * Speculation benchmark: times a job in which one map task straggles,
+ * with and without speculative execution. Each mapper reads its input
+ * through MR_Read(); the first attempt at the first file sleeps before
+ * every read, as if its disk were slow. A duplicate attempt reads at full
+ * speed, and once it wins the straggler reads end of file and returns.
+ *
+ * ./specbench [-s] [-f files] [-k kbytes] [-d delay_us]
+ *   -s  turn on speculation (default off)
+ *   -f  input files, written to a temporary directory (default 32)
+ *   -k  size of each file in KiB (default 64)
+ *   -d  microseconds the straggler sleeps per 4 KiB read (default 20000)
+ *
+ * Prints one line: mode, files, wall time in ms and the reads done by
+ * every attempt, which drop once the straggler stops after losing.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include "unistd.h"
+#include "mapreduce.h"
+
+static char *slowFile;
+static int slowTaken;
+static int delay = 20000;
+static long reads;
+
+static double Millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Emits one pair per 4 KiB read; only the first attempt at slowFile
+ * sleeps between reads
+ */
+void Map(char *file_name) {
+  int slow = strcmp(file_name, slowFile) == 0 &&
+      !__atomic_exchange_n(&slowTaken, 1, __ATOMIC_RELAXED);
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    perror(file_name);
+    exit(1);
+  }
+  char buf[4096];
+  while (1) {
+    if (slow) {
+      usleep(delay);
+    }
+    if (MR_Read(fd, buf, sizeof(buf)) <= 0) {
+      break;
+    }
+    __atomic_fetch_add(&reads, 1, __ATOMIC_RELAXED);
+    MR_Emit(file_name, "1");
+  }
+  close(fd);
+}
+
+void Reduce(char *key, Getter get_next, int partition_number) {
+  while (get_next(key, partition_number) != NULL) {
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int speculate = 0;
+  int files = 32;
+  int kbytes = 64;
+  int opt;
+  while ((opt = getopt(argc, argv, "sf:k:d:")) != -1) {
+    if (opt == 's') {
+      speculate = 1;
+    } else if (opt == 'f') {
+      files = atoi(optarg);
+    } else if (opt == 'k') {
+      kbytes = atoi(optarg);
+    } else if (opt == 'd') {
+      delay = atoi(optarg);
+    } else {
+      fprintf(stderr, "usage: specbench [-s] [-f files] [-k kbytes] "
+              "[-d delay_us]\n");
+      exit(1);
+    }
+  }
+  if (files < 2 || kbytes < 1 || delay < 0) {
+    fprintf(stderr, "specbench: needs 2 or more files of 1 KiB or more\n");
+    exit(1);
+  }
+
+  char dir[] = "/tmp/specbenchXXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  char **tasks = malloc((files + 1) * sizeof(char *));
+  tasks[0] = argv[0];
+  char *data = calloc(1024, kbytes);
+  for (int i = 0; i < files; i++) {
+    tasks[i + 1] = malloc(64);
+    snprintf(tasks[i + 1], 64, "%s/%d", dir, i);
+    FILE *out = fopen(tasks[i + 1], "w");
+    fwrite(data, 1024, kbytes, out);
+    fclose(out);
+  }
+  slowFile = tasks[1];
+
+  int mappers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (mappers < 2) {
+    mappers = 2;
+  }
+  MR_SetSpeculation(speculate);
+  double start = Millis();
+  MR_Run(files + 1, tasks, Map, mappers, Reduce, mappers,
+         MR_DefaultHashPartition, files);
+  double end = Millis();
+
+  printf("%-11s files %4d  wall %8.1f ms  reads %6ld\n",
+         speculate ? "speculation" : "plain", files, end - start, reads);
+
+  for (int i = 0; i < files; i++) {
+    unlink(tasks[i + 1]);
+    free(tasks[i + 1]);
+  }
+  rmdir(dir);
+  free(tasks);
+  free(data);
+  return 0;
+}
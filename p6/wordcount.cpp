@@ -0,0 +1,33 @@
+// Word count on the typed front-end: counts every whitespace-separated
+// word in the files named on the command line and prints "word count"
+// lines in word order within each partition.
+//
+// ./wordcount file...
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "mapreduce.hpp"
+
+int main(int argc, char *argv[]) {
+  mr::MapReduce<std::string, long> job(MR_AUTO, MR_AUTO, MR_AUTO);
+  job.Run(argc, argv,
+          [](const char *file, auto &emit) {
+            std::ifstream in(file);
+            std::string word;
+            while (in >> word) {
+              emit(word, 1L);
+            }
+          },
+          [](const std::string &key, auto values, int partition) {
+            long count = 0;
+            for (long v : values) {
+              count += v;
+            }
+            // Reducers run concurrently; one printf per line keeps
+            // lines whole
+            std::printf("%s %ld\n", key.c_str(), count);
+          });
+  return 0;
+}
@@ -6,8 +6,16 @@
 #include <assert.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <glob.h>
+#include <time.h>
 
 // On-disk file system format.
 // Both the kernel and user programs use this header file.
@@ -65,93 +73,2190 @@ struct dirent {
   char name[DIRSIZ];
 };
 
-int main(int argc, char* argv[]) {
-  int img;
-  img = open(argv[1], O_RDONLY);
-  // Validate FS image
-  if (img == -1) {
-    fprintf(stderr, "ERROR: image not found.\n");
+// Inode types
+#define T_DIR  1   // Directory
+#define T_FILE 2   // File
+#define T_DEV  3   // Device
+
+// What main does with the image: check it, show the changes a repair
+// would make (-n), repair it (-y), or diff it with another (-d)
+#define MODE_CHECK  0
+#define MODE_DRYRUN 1
+#define MODE_REPAIR 2
+#define MODE_DIFF   3
+
+// Largest single read of the streaming backend
+#define STREAM_CHUNK (1 << 20)
+
+// Most worker threads a sweep is split across
+#define MAX_THREADS 64
+
+// Fewest inodes or blocks worth handing to a thread of their own
+#define MIN_RANGE 1024
+
+// Bits per word of a block bitset
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+// A block bitset stores block b's bit like the on-disk bitmap does, as
+// bit b % 8 of byte b / 8, so the two can be compared word for word
+#define TEST_BIT(set, b) ((((unsigned char *)(set))[(b) / 8] >> ((b) % 8)) & 1)
+#define SET_BIT(set, b) (((unsigned char *)(set))[(b) / 8] |= 1 << ((b) % 8))
+#define CLEAR_BIT(set, b) \
+    (((unsigned char *)(set))[(b) / 8] &= ~(1 << ((b) % 8)))
+
+// Errors a check can report, each with its message below
+enum fsError {
+  FS_OK,
+  ERR_NOT_FOUND,
+  ERR_READ,
+  ERR_SUPERBLOCK,
+  ERR_BAD_INODE,
+  ERR_BAD_DIRECT,
+  ERR_BAD_INDIRECT,
+  ERR_BAD_SIZE,
+  ERR_ROOT,
+  ERR_CURRDIR,
+  ERR_DIRECT_TWICE,
+  ERR_INDIRECT_TWICE,
+  ERR_BITMAP_FREE,
+  ERR_BITMAP_USED,
+  ERR_INODE_FREE,
+  ERR_INODE_UNREFERENCED,
+  ERR_BAD_REFCOUNT,
+  ERR_DIR_TWICE,
+  ERR_PARENT_MISMATCH,
+  ERR_INACCESSIBLE,
+};
+
+char *errorMessages[] = {
+  [ERR_NOT_FOUND] = "ERROR: image not found.",
+  [ERR_READ] = "ERROR: cannot read image.",
+  [ERR_SUPERBLOCK] = "ERROR: bad superblock.",
+  [ERR_BAD_INODE] = "ERROR: bad inode.",
+  [ERR_BAD_DIRECT] = "ERROR: bad direct address in inode.",
+  [ERR_BAD_INDIRECT] = "ERROR: bad indirect address in inode.",
+  [ERR_BAD_SIZE] = "ERROR: bad size in inode.",
+  [ERR_ROOT] = "ERROR: root directory does not exist.",
+  [ERR_CURRDIR] = "ERROR: current directory mismatch.",
+  [ERR_DIRECT_TWICE] = "ERROR: direct address used more than once.",
+  [ERR_INDIRECT_TWICE] = "ERROR: indirect address used more than once.",
+  [ERR_BITMAP_FREE] =
+      "ERROR: bitmap marks data free but data block used by inode.",
+  [ERR_BITMAP_USED] = "ERROR: bitmap marks data block in use but not used.",
+  [ERR_INODE_FREE] = "ERROR: inode marked free but referred to in directory.",
+  [ERR_INODE_UNREFERENCED] =
+      "ERROR: inode marked in use but not found in a directory.",
+  [ERR_BAD_REFCOUNT] = "ERROR: bad reference count for file.",
+  [ERR_DIR_TWICE] =
+      "ERROR: directory appears more than once in file system.",
+  [ERR_PARENT_MISMATCH] = "ERROR: parent directory mismatch.",
+  [ERR_INACCESSIBLE] = "ERROR: inaccessible directory exists.",
+};
+
+// Data blocks read by the streaming backend: their numbers, sorted,
+// and their contents in the same order
+struct blockSet {
+  uint *blocks;
+  uint count;
+  unsigned char *data;
+};
+
+// Image being checked, and what the sweeps have learned about it
+struct fsCheck {
+  unsigned char *img;   // Whole image, or only blocks before dataStart
+                        // when streamed
+  size_t imgSize;       // Bytes in the image
+  struct superblock sb;
+  uint dataStart;       // First data block
+  unsigned long *used;  // Bitset of blocks owned by an inode
+  size_t usedWords;
+  uint *refs;           // Per inode: directory entries naming it
+  uint *parent;         // Per directory: a directory naming it, or 0
+  uint *dotdot;         // Per directory: its .. entry, or 0
+  int threads;          // Worker threads per sweep
+  unsigned long *dirty; // Repair only: bitset of blocks it changed
+  uint nextFree;        // Repair only: where to look for a free block
+  int stream;           // Read with pread rather than mapped
+  struct blockSet indirect;  // Streamed: every indirect block
+  struct blockSet dirData;   // Streamed: every block of a directory
+};
+
+// One thread's share of a sweep over inodes or blocks [lo, hi)
+struct sweep {
+  struct fsCheck *fs;
+  uint lo;
+  uint hi;
+  unsigned long *used;  // Blocks claimed in the range, inode sweep only
+  enum fsError err;     // First error in the range
+};
+
+// Returns block b of a set, or NULL if the set does not hold it
+void *SetBlock(struct blockSet *set, uint b) {
+  uint lo = 0;
+  uint hi = set->count;
+  while (lo < hi) {
+    uint mid = lo + (hi - lo) / 2;
+    if (set->blocks[mid] < b) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == set->count || set->blocks[lo] != b) {
+    return NULL;
+  }
+  return set->data + (size_t)lo * BSIZE;
+}
+
+// Returns block b, or NULL if it lies outside the image
+// A streamed image holds only the data blocks the checks read
+void *Block(struct fsCheck *fs, uint b) {
+  if (b >= fs->sb.size || ((uint64_t)b + 1) * BSIZE > fs->imgSize) {
+    return NULL;
+  }
+  if (fs->stream && b >= fs->dataStart) {
+    void *block = SetBlock(&fs->indirect, b);
+    return block != NULL ? block : SetBlock(&fs->dirData, b);
+  }
+  return fs->img + (size_t)b * BSIZE;
+}
+
+// Returns inode i; callers keep i below sb.ninodes
+struct dinode *Inode(struct fsCheck *fs, uint i) {
+  struct dinode *block = Block(fs, IBLOCK(i, fs->sb));
+  return block + i % IPB;
+}
+
+// Returns the on-disk bitmap as one bit array over every block
+// Bitmap blocks are consecutive, so bit b of the array is block b's
+unsigned char *Bitmap(struct fsCheck *fs) {
+  return Block(fs, fs->sb.bmapstart);
+}
+
+// Returns the first of words [from, to) that differs between the bit
+// arrays a and b, or to if they match
+size_t FirstDiffScalar(unsigned char *a, unsigned char *b, size_t from,
+    size_t to) {
+  for (size_t w = from; w < to; w++) {
+    uint64_t x, y;
+    memcpy(&x, a + w * 8, 8);
+    memcpy(&y, b + w * 8, 8);
+    if (x != y) {
+      return w;
+    }
+  }
+  return to;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// FirstDiffScalar, 16 bytes at a time
+__attribute__((target("sse2")))
+size_t FirstDiffSSE2(unsigned char *a, unsigned char *b, size_t from,
+    size_t to) {
+  size_t w = from;
+  for (; w + 2 <= to; w += 2) {
+    __m128i x = _mm_loadu_si128((__m128i *)(a + w * 8));
+    __m128i y = _mm_loadu_si128((__m128i *)(b + w * 8));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) {
+      break;
+    }
+  }
+  return FirstDiffScalar(a, b, w, to);
+}
+
+// FirstDiffScalar, 64 bytes at a time
+__attribute__((target("avx2")))
+size_t FirstDiffAVX2(unsigned char *a, unsigned char *b, size_t from,
+    size_t to) {
+  size_t w = from;
+  for (; w + 8 <= to; w += 8) {
+    __m256i x0 = _mm256_loadu_si256((__m256i *)(a + w * 8));
+    __m256i y0 = _mm256_loadu_si256((__m256i *)(b + w * 8));
+    __m256i x1 = _mm256_loadu_si256((__m256i *)(a + w * 8 + 32));
+    __m256i y1 = _mm256_loadu_si256((__m256i *)(b + w * 8 + 32));
+    __m256i diff = _mm256_or_si256(_mm256_xor_si256(x0, y0),
+        _mm256_xor_si256(x1, y1));
+    if (!_mm256_testz_si256(diff, diff)) {
+      break;
+    }
+  }
+  return FirstDiffScalar(a, b, w, to);
+}
+#endif
+
+// Word comparison for this CPU, picked by PickKernels()
+size_t (*firstDiff)(unsigned char *, unsigned char *, size_t, size_t) =
+    FirstDiffScalar;
+
+// Picks the widest word comparison the CPU supports
+void PickKernels() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    firstDiff = FirstDiffAVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    firstDiff = FirstDiffSSE2;
+  }
+#endif
+}
+
+// Checks the superblock against the image so every later block access
+// of metadata stays inside it
+enum fsError CheckSuperblock(struct fsCheck *fs) {
+  if (fs->imgSize < 2 * BSIZE) {
+    return ERR_SUPERBLOCK;
+  }
+  memcpy(&fs->sb, fs->img + BSIZE, sizeof(fs->sb));
+  struct superblock *sb = &fs->sb;
+
+  // Regions must follow each other in order: boot, super, log, inodes,
+  // bitmap, data; sums are in 64 bits so huge fields cannot wrap
+  uint64_t logEnd = (uint64_t)sb->logstart + sb->nlog;
+  uint64_t inodeEnd = (uint64_t)sb->inodestart + (sb->ninodes - 1) / IPB + 1;
+  uint64_t dataStart = (uint64_t)sb->bmapstart + sb->size / BPB + 1;
+  if (sb->ninodes <= ROOTINO || sb->size > fs->imgSize / BSIZE ||
+      sb->logstart < 2 || logEnd > sb->inodestart || inodeEnd > sb->bmapstart ||
+      sb->bmapstart >= sb->size || dataStart > sb->size) {
+    return ERR_SUPERBLOCK;
+  }
+  fs->dataStart = dataStart;
+  return FS_OK;
+}
+
+// Claims data block b for an inode in the bitset used
+enum fsError UseBlock(struct fsCheck *fs, unsigned long *used, uint b,
+    enum fsError bad, enum fsError twice) {
+  if (b < fs->dataStart || b >= fs->sb.size) {
+    return bad;
+  }
+  if (TEST_BIT(used, b)) {
+    return twice;
+  }
+  SET_BIT(used, b);
+  return FS_OK;
+}
+
+// Inode sweep: checks each inode's type, block addresses and size, and
+// records the blocks the inode owns in used
+enum fsError CheckInode(struct fsCheck *fs, unsigned long *used,
+    struct dinode *di) {
+  enum fsError err;
+  uint blocks = 0;
+
+  if (di->type == 0) {
+    return FS_OK;
+  }
+  if (di->type != T_DIR && di->type != T_FILE && di->type != T_DEV) {
+    return ERR_BAD_INODE;
+  }
+
+  for (int k = 0; k < NDIRECT; k++) {
+    if (di->addrs[k] != 0) {
+      err = UseBlock(fs, used, di->addrs[k], ERR_BAD_DIRECT,
+          ERR_DIRECT_TWICE);
+      if (err != FS_OK) {
+        return err;
+      }
+      blocks++;
+    }
+  }
+
+  if (di->addrs[NDIRECT] != 0) {
+    err = UseBlock(fs, used, di->addrs[NDIRECT], ERR_BAD_INDIRECT,
+        ERR_INDIRECT_TWICE);
+    if (err != FS_OK) {
+      return err;
+    }
+    uint *a = Block(fs, di->addrs[NDIRECT]);
+    for (int k = 0; k < NINDIRECT; k++) {
+      if (a[k] != 0) {
+        err = UseBlock(fs, used, a[k], ERR_BAD_INDIRECT,
+            ERR_INDIRECT_TWICE);
+        if (err != FS_OK) {
+          return err;
+        }
+        blocks++;
+      }
+    }
+  }
+
+  // The size must need exactly the blocks the inode holds
+  if (di->size > blocks * BSIZE ||
+      (blocks > 0 && di->size <= (blocks - 1) * BSIZE)) {
+    return ERR_BAD_SIZE;
+  }
+  return FS_OK;
+}
+
+// Returns the block holding byte off of a file, or 0 if it has none
+uint FileBlock(struct fsCheck *fs, struct dinode *di, uint off) {
+  uint k = off / BSIZE;
+  if (k < NDIRECT) {
+    return di->addrs[k];
+  }
+  if (k >= MAXFILE || di->addrs[NDIRECT] == 0) {
+    return 0;
+  }
+  uint *a = Block(fs, di->addrs[NDIRECT]);
+  return a[k - NDIRECT];
+}
+
+// Returns the entry at byte off of directory di, or NULL if that part
+// of the directory has no block
+struct dirent *DirEntry(struct fsCheck *fs, struct dinode *di, uint off) {
+  uint b = FileBlock(fs, di, off);
+  if (b == 0) {
+    return NULL;
+  }
+  return (struct dirent *)((unsigned char *)Block(fs, b) + off % BSIZE);
+}
+
+// Directory sweep: checks the . and .. entries of directory inum,
+// counts the references its other entries make, and records it as the
+// parent of the directories it names
+enum fsError CheckDirectory(struct fsCheck *fs, uint inum,
+    struct dinode *di) {
+  int sawDot = 0;
+
+  for (uint off = 0; off + sizeof(struct dirent) <= di->size;
+      off += sizeof(struct dirent)) {
+    struct dirent *de = DirEntry(fs, di, off);
+    if (de == NULL || de->inum == 0) {
+      continue;
+    }
+
+    if (strncmp(de->name, ".", DIRSIZ) == 0) {
+      if (de->inum != inum) {
+        return inum == ROOTINO ? ERR_ROOT : ERR_CURRDIR;
+      }
+      sawDot = 1;
+      continue;
+    }
+    if (strncmp(de->name, "..", DIRSIZ) == 0) {
+      if (inum == ROOTINO && de->inum != ROOTINO) {
+        return ERR_ROOT;
+      }
+      fs->dotdot[inum] = de->inum;
+      continue;
+    }
+
+    if (de->inum >= fs->sb.ninodes || Inode(fs, de->inum)->type == 0) {
+      return ERR_INODE_FREE;
+    }
+    __atomic_fetch_add(&fs->refs[de->inum], 1, __ATOMIC_RELAXED);
+
+    // A directory named twice is reported by its count, so any one
+    // of the directories naming it may be kept
+    if (Inode(fs, de->inum)->type == T_DIR) {
+      __atomic_store_n(&fs->parent[de->inum], inum, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (!sawDot) {
+    return inum == ROOTINO ? ERR_ROOT : ERR_CURRDIR;
+  }
+  return FS_OK;
+}
+
+// Inode sweep over one range, claiming blocks in the range's own bitset
+void *InodeSweep(void *arg) {
+  struct sweep *part = arg;
+  for (uint i = part->lo; i < part->hi && part->err == FS_OK; i++) {
+    part->err = CheckInode(part->fs, part->used, Inode(part->fs, i));
+  }
+  return NULL;
+}
+
+// Directory sweep over the directories among one range of inodes
+void *DirectorySweep(void *arg) {
+  struct sweep *part = arg;
+  for (uint i = part->lo; i < part->hi && part->err == FS_OK; i++) {
+    struct dinode *di = Inode(part->fs, i);
+    if (di->type == T_DIR) {
+      part->err = CheckDirectory(part->fs, i, di);
+    }
+  }
+  return NULL;
+}
+
+// Compares one block's bit in the owned and on-disk bitmaps
+enum fsError CheckBit(unsigned char *owned, unsigned char *marked, uint b) {
+  if (TEST_BIT(owned, b) == TEST_BIT(marked, b)) {
+    return FS_OK;
+  }
+  return TEST_BIT(owned, b) ? ERR_BITMAP_FREE : ERR_BITMAP_USED;
+}
+
+// Bitmap sweep over one range of data blocks
+// Whole 64-bit words are compared with the vector kernel, and only a word
+// that differs is taken apart bit by bit
+void *BitmapSweep(void *arg) {
+  struct sweep *part = arg;
+  unsigned char *owned = (unsigned char *)part->fs->used;
+  unsigned char *marked = Bitmap(part->fs);
+  uint b = part->lo;
+
+  for (; b < part->hi && b % 64 != 0; b++) {
+    if ((part->err = CheckBit(owned, marked, b)) != FS_OK) {
+      return NULL;
+    }
+  }
+  size_t end = part->hi / 64;
+  if (b / 64 < end) {
+    b = firstDiff(owned, marked, b / 64, end) * 64;
+  }
+  for (; b < part->hi; b++) {
+    if ((part->err = CheckBit(owned, marked, b)) != FS_OK) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+// Checks the links to inode i against the directory sweep's counts: it
+// must be named somewhere, a file as often as its nlink says, and a
+// directory exactly once, by the directory its .. entry names
+enum fsError CheckLinks(struct fsCheck *fs, uint i) {
+  struct dinode *di = Inode(fs, i);
+
+  if (di->type == 0) {
+    return FS_OK;
+  }
+  if (fs->refs[i] == 0) {
+    return ERR_INODE_UNREFERENCED;
+  }
+  if (di->type == T_FILE && di->nlink != fs->refs[i]) {
+    return ERR_BAD_REFCOUNT;
+  }
+  if (di->type == T_DIR && fs->refs[i] > 1) {
+    return ERR_DIR_TWICE;
+  }
+  if (di->type == T_DIR && fs->dotdot[i] != fs->parent[i]) {
+    return ERR_PARENT_MISMATCH;
+  }
+  return FS_OK;
+}
+
+// Reference sweep over one range of inodes
+void *RefSweep(void *arg) {
+  struct sweep *part = arg;
+  for (uint i = part->lo; i < part->hi; i++) {
+    if ((part->err = CheckLinks(part->fs, i)) != FS_OK) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Children of every directory, grouped by parent, for walking the tree
+struct tree {
+  uint *start;          // Children of d are children[start[d]..start[d+1])
+  uint *children;
+  uint *queue;
+  unsigned char *seen;  // Directories a walk has reached
+};
+
+// Builds the tree from the parent map. Each directory has one parent by
+// now, so the children of all directories fit in one array.
+void BuildTree(struct fsCheck *fs, struct tree *t) {
+  uint n = fs->sb.ninodes;
+  t->start = calloc(n + 1, sizeof(uint));
+  t->children = malloc(n * sizeof(uint));
+  t->queue = malloc(n * sizeof(uint));
+  t->seen = calloc(n, 1);
+
+  for (uint i = ROOTINO + 1; i < n; i++) {
+    if (Inode(fs, i)->type == T_DIR) {
+      t->start[fs->parent[i] + 1]++;
+    }
+  }
+  for (uint i = 0; i < n; i++) {
+    t->start[i + 1] += t->start[i];
+  }
+  for (uint i = ROOTINO + 1; i < n; i++) {
+    if (Inode(fs, i)->type == T_DIR) {
+      t->children[t->start[fs->parent[i]]++] = i;
+    }
+  }
+  // Filling moved each start to the next parent's; shift them back
+  for (uint i = n; i > 0; i--) {
+    t->start[i] = t->start[i - 1];
+  }
+  t->start[0] = 0;
+}
+
+// Marks every directory reachable from directory d as seen, breadth first
+void Walk(struct tree *t, uint d) {
+  if (t->seen[d]) {
+    return;
+  }
+  uint head = 0;
+  uint tail = 0;
+  t->queue[tail++] = d;
+  t->seen[d] = 1;
+  while (head < tail) {
+    d = t->queue[head++];
+    for (uint c = t->start[d]; c < t->start[d + 1]; c++) {
+      if (!t->seen[t->children[c]]) {
+        t->seen[t->children[c]] = 1;
+        t->queue[tail++] = t->children[c];
+      }
+    }
+  }
+}
+
+void FreeTree(struct tree *t) {
+  free(t->start);
+  free(t->children);
+  free(t->queue);
+  free(t->seen);
+}
+
+// Walks the directory tree from the root and checks that it reaches
+// every directory
+enum fsError CheckReachable(struct fsCheck *fs) {
+  struct tree t;
+  BuildTree(fs, &t);
+  Walk(&t, ROOTINO);
+
+  enum fsError err = FS_OK;
+  for (uint i = ROOTINO + 1; i < fs->sb.ninodes && err == FS_OK; i++) {
+    if (Inode(fs, i)->type == T_DIR && !t.seen[i]) {
+      err = ERR_INACCESSIBLE;
+    }
+  }
+  FreeTree(&t);
+  return err;
+}
+
+// Splits [lo, hi) into ranges, one per thread, and runs fn on each
+// Returns the number of ranges in parts
+int RunSweep(struct fsCheck *fs, void *(*fn)(void *), uint lo, uint hi,
+    struct sweep *parts) {
+  int n = (hi - lo + MIN_RANGE - 1) / MIN_RANGE;
+  if (n > fs->threads) {
+    n = fs->threads;
+  }
+  if (n < 1) {
+    n = 1;
+  }
+
+  pthread_t threads[MAX_THREADS];
+  for (int t = 0; t < n; t++) {
+    parts[t].fs = fs;
+    parts[t].lo = lo + (unsigned long)(hi - lo) * t / n;
+    parts[t].hi = lo + (unsigned long)(hi - lo) * (t + 1) / n;
+    parts[t].err = FS_OK;
+    if (n > 1) {
+      pthread_create(&threads[t], NULL, fn, &parts[t]);
+    } else {
+      fn(&parts[t]);
+    }
+  }
+  for (int t = 0; t < n && n > 1; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  return n;
+}
+
+// Returns the first error of a sweep, in range order, so the result is
+// the one a single-threaded sweep would give
+enum fsError FirstError(struct sweep *parts, int n) {
+  for (int t = 0; t < n; t++) {
+    if (parts[t].err != FS_OK) {
+      return parts[t].err;
+    }
+  }
+  return FS_OK;
+}
+
+// Inode sweep: each range claims blocks in its own bitset. Merging them
+// in range order finds blocks also used by an earlier range; that range,
+// like one with an error of its own, is replayed against the merged
+// bitset to report the error a single-threaded sweep would have hit.
+enum fsError CheckInodes(struct fsCheck *fs, struct sweep *parts) {
+  enum fsError err = FS_OK;
+
+  for (int t = 0; t < fs->threads; t++) {
+    parts[t].used = calloc(fs->usedWords, sizeof(unsigned long));
+  }
+  int n = RunSweep(fs, InodeSweep, 1, fs->sb.ninodes, parts);
+
+  for (int t = 0; t < n && err == FS_OK; t++) {
+    int overlap = 0;
+    for (size_t w = 0; w < fs->usedWords; w++) {
+      overlap |= (fs->used[w] & parts[t].used[w]) != 0;
+      fs->used[w] |= parts[t].used[w];
+    }
+    if (parts[t].err == FS_OK && !overlap) {
+      continue;
+    }
+
+    // Blocks claimed by this range were merged in above; start over
+    // from the earlier ranges' blocks alone
+    for (size_t w = 0; w < fs->usedWords; w++) {
+      fs->used[w] = 0;
+      for (int u = 0; u < t; u++) {
+        fs->used[w] |= parts[u].used[w];
+      }
+    }
+    for (uint i = parts[t].lo; i < parts[t].hi && err == FS_OK; i++) {
+      err = CheckInode(fs, fs->used, Inode(fs, i));
+    }
+  }
+
+  for (int t = 0; t < fs->threads; t++) {
+    free(parts[t].used);
+    parts[t].used = NULL;
+  }
+  return err;
+}
+
+// Allocates what the sweeps learn about an image, all clear
+void AllocState(struct fsCheck *fs) {
+  fs->usedWords = (fs->sb.size + WORD_BITS - 1) / WORD_BITS;
+  fs->used = calloc(fs->usedWords, sizeof(unsigned long));
+  fs->refs = calloc(fs->sb.ninodes, sizeof(uint));
+  fs->parent = calloc(fs->sb.ninodes, sizeof(uint));
+  fs->dotdot = calloc(fs->sb.ninodes, sizeof(uint));
+}
+
+void FreeState(struct fsCheck *fs) {
+  free(fs->used);
+  free(fs->refs);
+  free(fs->parent);
+  free(fs->dotdot);
+  fs->used = NULL;
+  fs->refs = NULL;
+  fs->parent = NULL;
+  fs->dotdot = NULL;
+}
+
+// Streaming backend: reads count blocks from block first on into buf,
+// in reads of at most STREAM_CHUNK bytes
+// Returns 0, or -1 if the blocks run past the image or cannot be read
+int ReadBlocks(struct fsCheck *fs, int img, uint first, uint count,
+    unsigned char *buf) {
+  if (((uint64_t)first + count) * BSIZE > fs->imgSize) {
+    return -1;
+  }
+  size_t left = (size_t)count * BSIZE;
+  off_t off = (off_t)first * BSIZE;
+  while (left > 0) {
+    ssize_t got = pread(img, buf, left < STREAM_CHUNK ? left : STREAM_CHUNK,
+        off);
+    if (got <= 0) {
+      return -1;
+    }
+    buf += got;
+    off += got;
+    left -= got;
+  }
+  return 0;
+}
+
+int CompareBlocks(const void *a, const void *b) {
+  uint x = *(uint *)a;
+  uint y = *(uint *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Sorts the block numbers of a set, drops repeats and reads the blocks.
+// All runs of consecutive blocks are announced to the kernel first so
+// it can read ahead, then each is read with as few preads as it takes.
+int LoadSet(struct fsCheck *fs, struct blockSet *set, int img) {
+  qsort(set->blocks, set->count, sizeof(uint), CompareBlocks);
+  uint n = 0;
+  for (uint i = 0; i < set->count; i++) {
+    if (n == 0 || set->blocks[i] != set->blocks[n - 1]) {
+      set->blocks[n++] = set->blocks[i];
+    }
+  }
+  set->count = n;
+  set->data = malloc((size_t)n * BSIZE + 1);
+
+  for (int read = 0; read <= 1; read++) {
+    for (uint i = 0; i < n;) {
+      uint j = i + 1;
+      while (j < n && set->blocks[j] == set->blocks[j - 1] + 1) {
+        j++;
+      }
+      if (!read) {
+        posix_fadvise(img, (off_t)set->blocks[i] * BSIZE,
+            (off_t)(j - i) * BSIZE, POSIX_FADV_WILLNEED);
+      } else if (ReadBlocks(fs, img, set->blocks[i], j - i,
+          set->data + (size_t)i * BSIZE) != 0) {
+        return -1;
+      }
+      i = j;
+    }
+  }
+  return 0;
+}
+
+// Adds block b to a set if it is a data block; others are never read
+void AddBlock(struct fsCheck *fs, struct blockSet *set, uint b) {
+  if (b >= fs->dataStart && b < fs->sb.size) {
+    set->blocks[set->count++] = b;
+  }
+}
+
+// Streaming backend: reads the image without mapping it, so it works on
+// block devices and on images larger than memory. Every block before the
+// data blocks is read front to back in large reads; of the data blocks
+// only indirect blocks, and then the blocks of directories, are read,
+// since no check looks at the data of files.
+enum fsError StreamImage(struct fsCheck *fs, int img) {
+  uint head = fs->imgSize < 2 * BSIZE ? 0 : 2;
+  fs->img = malloc(2 * BSIZE);
+  if (ReadBlocks(fs, img, 0, head, fs->img) != 0) {
+    return ERR_READ;
+  }
+  enum fsError err = CheckSuperblock(fs);
+  if (err != FS_OK) {
+    return err;
+  }
+
+  posix_fadvise(img, 0, (off_t)fs->dataStart * BSIZE, POSIX_FADV_SEQUENTIAL);
+  fs->img = realloc(fs->img, (size_t)fs->dataStart * BSIZE);
+  if (ReadBlocks(fs, img, 0, fs->dataStart, fs->img) != 0) {
+    return ERR_READ;
+  }
+
+  uint n = fs->sb.ninodes;
+  fs->indirect.blocks = malloc(n * sizeof(uint));
+  for (uint i = 0; i < n; i++) {
+    struct dinode *di = Inode(fs, i);
+    if (di->type != 0) {
+      AddBlock(fs, &fs->indirect, di->addrs[NDIRECT]);
+    }
+  }
+  if (LoadSet(fs, &fs->indirect, img) != 0) {
+    return ERR_READ;
+  }
+
+  size_t dirBlocks = 0;
+  for (uint i = 0; i < n; i++) {
+    dirBlocks += Inode(fs, i)->type == T_DIR ? MAXFILE : 0;
+  }
+  fs->dirData.blocks = malloc(dirBlocks * sizeof(uint) + 1);
+  for (uint i = 0; i < n; i++) {
+    struct dinode *di = Inode(fs, i);
+    if (di->type != T_DIR) {
+      continue;
+    }
+    for (int k = 0; k < NDIRECT; k++) {
+      AddBlock(fs, &fs->dirData, di->addrs[k]);
+    }
+    uint ib = di->addrs[NDIRECT];
+    uint *a = ib >= fs->dataStart ? Block(fs, ib) : NULL;
+    for (int k = 0; a != NULL && k < NINDIRECT; k++) {
+      AddBlock(fs, &fs->dirData, a[k]);
+    }
+  }
+  if (LoadSet(fs, &fs->dirData, img) != 0) {
+    return ERR_READ;
+  }
+  return FS_OK;
+}
+
+// Runs every check in order: one sweep over the inode table, one over
+// directory data, one over the bitmap, one over the reference counts,
+// and a walk of the directory tree
+// Each sweep is split across fs->threads threads
+enum fsError CheckImage(struct fsCheck *fs) {
+  struct sweep parts[MAX_THREADS];
+  enum fsError err = CheckSuperblock(fs);
+  if (err != FS_OK) {
+    return err;
+  }
+  AllocState(fs);
+
+  err = CheckInodes(fs, parts);
+  if (err != FS_OK) {
+    return err;
+  }
+
+  if (Inode(fs, ROOTINO)->type != T_DIR) {
+    return ERR_ROOT;
+  }
+  int n = RunSweep(fs, DirectorySweep, 1, fs->sb.ninodes, parts);
+  err = FirstError(parts, n);
+  if (err != FS_OK) {
+    return err;
+  }
+
+  n = RunSweep(fs, BitmapSweep, fs->dataStart, fs->sb.size, parts);
+  err = FirstError(parts, n);
+  if (err != FS_OK) {
+    return err;
+  }
+
+  n = RunSweep(fs, RefSweep, ROOTINO + 1, fs->sb.ninodes, parts);
+  err = FirstError(parts, n);
+  if (err != FS_OK) {
+    return err;
+  }
+  return CheckReachable(fs);
+}
+
+// Repair mode. Fixes are made in the image's private mapping, which the
+// kernel copies block by block on first write, and each changed block is
+// marked dirty; the image file itself is only written by WriteChanges().
+
+// Prints one fix
+void Report(char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  printf("fixed: ");
+  vprintf(fmt, args);
+  printf("\n");
+  va_end(args);
+}
+
+// Copies n bytes from src over dst, which lies in one block of the
+// image, and marks that block dirty if they differ
+void Change(struct fsCheck *fs, void *dst, void *src, size_t n) {
+  if (memcmp(dst, src, n) == 0) {
+    return;
+  }
+  size_t b = ((unsigned char *)dst - fs->img) / BSIZE;
+  SET_BIT(fs->dirty, b);
+  memmove(dst, src, n);
+}
+
+// Claims and zeroes the first free data block; returns 0 if none is left
+uint AllocBlock(struct fsCheck *fs) {
+  static unsigned char zero[BSIZE];
+  for (; fs->nextFree < fs->sb.size; fs->nextFree++) {
+    uint b = fs->nextFree;
+    if (!TEST_BIT(fs->used, b)) {
+      SET_BIT(fs->used, b);
+      Change(fs, Block(fs, b), zero, BSIZE);
+      fs->nextFree++;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Points block k of a file at b, allocating its indirect block if needed
+// Returns 0, or -1 if no block is left for the indirect block
+int SetFileBlock(struct fsCheck *fs, struct dinode *di, uint k, uint b) {
+  if (k < NDIRECT) {
+    Change(fs, &di->addrs[k], &b, sizeof(b));
+    return 0;
+  }
+  if (di->addrs[NDIRECT] == 0) {
+    if (b == 0) {
+      return 0;
+    }
+    uint ib = AllocBlock(fs);
+    if (ib == 0) {
+      return -1;
+    }
+    Change(fs, &di->addrs[NDIRECT], &ib, sizeof(ib));
+  }
+  uint *a = Block(fs, di->addrs[NDIRECT]);
+  Change(fs, &a[k - NDIRECT], &b, sizeof(b));
+  return 0;
+}
+
+// Adds the entry name for inum to directory dir, in its first free slot
+// or at its end. Returns 0, or -1 if the directory cannot grow.
+int AddEntry(struct fsCheck *fs, uint dir, char *name, uint inum) {
+  struct dinode *di = Inode(fs, dir);
+  struct dirent de;
+  memset(&de, 0, sizeof(de));
+  de.inum = inum;
+  memcpy(de.name, name, strnlen(name, DIRSIZ));
+
+  uint off;
+  for (off = 0; off + sizeof(de) <= di->size; off += sizeof(de)) {
+    struct dirent *slot = DirEntry(fs, di, off);
+    if (slot != NULL && slot->inum == 0) {
+      Change(fs, slot, &de, sizeof(de));
+      return 0;
+    }
+  }
+
+  if (off / BSIZE >= MAXFILE) {
+    return -1;
+  }
+  if (FileBlock(fs, di, off) == 0) {
+    uint b = AllocBlock(fs);
+    if (b == 0) {
+      return -1;
+    }
+    if (SetFileBlock(fs, di, off / BSIZE, b) != 0) {
+      CLEAR_BIT(fs->used, b);
+      return -1;
+    }
+  }
+  Change(fs, DirEntry(fs, di, off), &de, sizeof(de));
+  uint size = off + sizeof(de);
+  Change(fs, &di->size, &size, sizeof(size));
+  return 0;
+}
+
+// Clears entry de of directory dir
+void ClearEntry(struct fsCheck *fs, uint dir, struct dirent *de) {
+  struct dirent zero;
+  memset(&zero, 0, sizeof(zero));
+  Report("directory %u: removed entry %.*s for inode %u", dir, DIRSIZ,
+      de->name, de->inum);
+  Change(fs, de, &zero, sizeof(zero));
+}
+
+// Points the .. entry of directory d at p, adding one if it has none
+void SetDotDot(struct fsCheck *fs, uint d, uint p) {
+  struct dinode *di = Inode(fs, d);
+  ushort inum = p;
+  int found = 0;
+
+  for (uint off = 0; off + sizeof(struct dirent) <= di->size;
+      off += sizeof(struct dirent)) {
+    struct dirent *de = DirEntry(fs, di, off);
+    if (de != NULL && de->inum != 0 && strncmp(de->name, "..", DIRSIZ) == 0) {
+      Change(fs, &de->inum, &inum, sizeof(inum));
+      found = 1;
+    }
+  }
+  if (found || AddEntry(fs, d, "..", p) == 0) {
+    Report("directory %u: .. set to %u", d, p);
+    fs->dotdot[d] = p;
+  }
+}
+
+// Counts the blocks a file holds
+uint CountBlocks(struct fsCheck *fs, struct dinode *di) {
+  uint blocks = 0;
+  for (uint k = 0; k < MAXFILE; k++) {
+    blocks += FileBlock(fs, di, k * BSIZE) != 0;
+  }
+  return blocks;
+}
+
+// Repair inode sweep: clears inode i if its type is bad, or makes it a
+// directory if it is the root, drops block addresses that are out of
+// range or claimed by an earlier inode, and fixes a size that does not
+// fit the blocks left
+void RepairInode(struct fsCheck *fs, uint i) {
+  struct dinode *di = Inode(fs, i);
+  uint zero = 0;
+
+  if (di->type == 0) {
+    return;
+  }
+  if (i == ROOTINO && di->type != T_DIR && di->type != T_FILE &&
+      di->type != T_DEV) {
+    short type = T_DIR;
+    Report("inode %u: type %d set to %d", i, di->type, type);
+    Change(fs, &di->type, &type, sizeof(type));
+  }
+  if (di->type != T_DIR && di->type != T_FILE && di->type != T_DEV) {
+    struct dinode clear;
+    memset(&clear, 0, sizeof(clear));
+    Report("inode %u: cleared, bad type %d", i, di->type);
+    Change(fs, di, &clear, sizeof(clear));
+    return;
+  }
+
+  for (int k = 0; k < NDIRECT; k++) {
+    if (di->addrs[k] != 0 && UseBlock(fs, fs->used, di->addrs[k],
+        ERR_BAD_DIRECT, ERR_DIRECT_TWICE) != FS_OK) {
+      Report("inode %u: dropped block %u", i, di->addrs[k]);
+      Change(fs, &di->addrs[k], &zero, sizeof(zero));
+    }
+  }
+  if (di->addrs[NDIRECT] != 0 && UseBlock(fs, fs->used, di->addrs[NDIRECT],
+      ERR_BAD_INDIRECT, ERR_INDIRECT_TWICE) != FS_OK) {
+    Report("inode %u: dropped indirect block %u", i, di->addrs[NDIRECT]);
+    Change(fs, &di->addrs[NDIRECT], &zero, sizeof(zero));
+  }
+  if (di->addrs[NDIRECT] != 0) {
+    uint *a = Block(fs, di->addrs[NDIRECT]);
+    for (int k = 0; k < NINDIRECT; k++) {
+      if (a[k] != 0 && UseBlock(fs, fs->used, a[k], ERR_BAD_INDIRECT,
+          ERR_INDIRECT_TWICE) != FS_OK) {
+        Report("inode %u: dropped block %u", i, a[k]);
+        Change(fs, &a[k], &zero, sizeof(zero));
+      }
+    }
+  }
+
+  uint blocks = CountBlocks(fs, di);
+  if (di->size <= blocks * BSIZE &&
+      (blocks == 0 || di->size > (blocks - 1) * BSIZE)) {
+    return;
+  }
+
+  // Blocks past the end of the file hold no data of it, so free them;
+  // a size past the blocks left is cut back to them
+  uint size = di->size;
+  if (blocks > 0 && size <= (blocks - 1) * BSIZE) {
+    for (uint k = (size + BSIZE - 1) / BSIZE; k < MAXFILE; k++) {
+      uint b = FileBlock(fs, di, k * BSIZE);
+      if (b != 0) {
+        CLEAR_BIT(fs->used, b);
+        SetFileBlock(fs, di, k, 0);
+      }
+    }
+    if (size <= NDIRECT * BSIZE && di->addrs[NDIRECT] != 0) {
+      CLEAR_BIT(fs->used, di->addrs[NDIRECT]);
+      Change(fs, &di->addrs[NDIRECT], &zero, sizeof(zero));
+    }
+    Report("inode %u: freed %u blocks past size %u", i,
+        blocks - CountBlocks(fs, di), size);
+    blocks = CountBlocks(fs, di);
+  }
+  if (size > blocks * BSIZE) {
+    size = blocks * BSIZE;
+    Report("inode %u: size %u set to %u", i, di->size, size);
+    Change(fs, &di->size, &size, sizeof(size));
+  }
+}
+
+// Fixes the . entry of directory i, and the .. entry of the root
+void RepairDots(struct fsCheck *fs, uint i) {
+  struct dinode *di = Inode(fs, i);
+  ushort self = i;
+  int sawDot = 0;
+
+  for (uint off = 0; off + sizeof(struct dirent) <= di->size;
+      off += sizeof(struct dirent)) {
+    struct dirent *de = DirEntry(fs, di, off);
+    if (de == NULL || de->inum == 0) {
+      continue;
+    }
+    if (strncmp(de->name, ".", DIRSIZ) == 0) {
+      if (de->inum != i) {
+        Report("directory %u: . set to %u", i, i);
+        Change(fs, &de->inum, &self, sizeof(self));
+      }
+      sawDot = 1;
+    } else if (strncmp(de->name, "..", DIRSIZ) == 0) {
+      if (i == ROOTINO && de->inum != ROOTINO) {
+        Report("directory %u: .. set to %u", i, i);
+        Change(fs, &de->inum, &self, sizeof(self));
+      }
+      fs->dotdot[i] = de->inum;
+    }
+  }
+  if (!sawDot && AddEntry(fs, i, ".", i) == 0) {
+    Report("directory %u: added .", i);
+  }
+}
+
+// Returns the directory inode an entry of directory i names, or 0 if it
+// names a file, the root, i itself or no inode in use
+uint ChildDirectory(struct fsCheck *fs, uint i, struct dirent *de) {
+  if (de->inum >= fs->sb.ninodes || de->inum == ROOTINO || de->inum == i ||
+      Inode(fs, de->inum)->type != T_DIR) {
+    return 0;
+  }
+  return de->inum;
+}
+
+// Fixes the entries of directory i, other than . and .., and counts the
+// references of those it keeps. Entries naming a free inode are dropped,
+// and a directory keeps one name: the one in the directory its .. entry
+// names if there is one, set aside in parent by the first pass.
+void RepairEntries(struct fsCheck *fs, uint i, int firstPass) {
+  struct dinode *di = Inode(fs, i);
+
+  for (uint off = 0; off + sizeof(struct dirent) <= di->size;
+      off += sizeof(struct dirent)) {
+    struct dirent *de = DirEntry(fs, di, off);
+    if (de == NULL || de->inum == 0 || strncmp(de->name, ".", DIRSIZ) == 0 ||
+        strncmp(de->name, "..", DIRSIZ) == 0) {
+      continue;
+    }
+    uint d = ChildDirectory(fs, i, de);
+
+    if (firstPass) {
+      if (d != 0 && fs->dotdot[d] == i && fs->parent[d] == 0) {
+        fs->parent[d] = i;
+      }
+      continue;
+    }
+
+    if (de->inum >= fs->sb.ninodes || Inode(fs, de->inum)->type == 0 ||
+        de->inum == i) {
+      ClearEntry(fs, i, de);
+    } else if (d == 0) {
+      fs->refs[de->inum]++;
+    } else if (fs->refs[d] == 0 &&
+        (fs->parent[d] == 0 || fs->parent[d] == i)) {
+      fs->parent[d] = i;
+      fs->refs[d] = 1;
+    } else {
+      ClearEntry(fs, i, de);
+    }
+  }
+}
+
+// Returns the lost+found directory in the root, making it if there is
+// none, or 0 if there is no free inode or block for it
+uint LostFound(struct fsCheck *fs) {
+  struct dinode *root = Inode(fs, ROOTINO);
+  for (uint off = 0; off + sizeof(struct dirent) <= root->size;
+      off += sizeof(struct dirent)) {
+    struct dirent *de = DirEntry(fs, root, off);
+    if (de != NULL && strncmp(de->name, "lost+found", DIRSIZ) == 0 &&
+        ChildDirectory(fs, ROOTINO, de) != 0 &&
+        fs->parent[de->inum] == ROOTINO) {
+      return de->inum;
+    }
+  }
+
+  uint lf = ROOTINO + 1;
+  while (lf < fs->sb.ninodes && Inode(fs, lf)->type != 0) {
+    lf++;
+  }
+  if (lf == fs->sb.ninodes) {
+    return 0;
+  }
+  struct dinode di;
+  memset(&di, 0, sizeof(di));
+  di.type = T_DIR;
+  di.nlink = 1;
+  Change(fs, Inode(fs, lf), &di, sizeof(di));
+  if (AddEntry(fs, lf, ".", lf) != 0 || AddEntry(fs, lf, "..", ROOTINO) != 0 ||
+      AddEntry(fs, ROOTINO, "lost+found", lf) != 0) {
+    return 0;
+  }
+  Report("directory %u: made lost+found", lf);
+  fs->refs[lf] = 1;
+  fs->parent[lf] = ROOTINO;
+  fs->dotdot[lf] = ROOTINO;
+  return lf;
+}
+
+// Moves every inode in use that the root does not reach into
+// lost+found, named by its number. A directory is taken out of the
+// directory naming it, so cycles of unreachable directories are broken,
+// and brings along the directories under it.
+void RepairOrphans(struct fsCheck *fs) {
+  struct tree t;
+  BuildTree(fs, &t);
+  Walk(&t, ROOTINO);
+
+  uint lf = 0;
+  for (uint i = ROOTINO + 1; i < fs->sb.ninodes; i++) {
+    struct dinode *di = Inode(fs, i);
+    if (di->type == 0 || (di->type == T_DIR ? t.seen[i] : fs->refs[i] > 0)) {
+      continue;
+    }
+    if (lf == 0) {
+      if ((lf = LostFound(fs)) == 0) {
+        break;
+      }
+      t.seen[lf] = 1;
+    }
+
+    char name[DIRSIZ + 1];
+    snprintf(name, sizeof(name), "#%u", i);
+    if (AddEntry(fs, lf, name, i) != 0) {
+      break;
+    }
+    Report("inode %u: moved to lost+found", i);
+    fs->refs[i] = 1;
+
+    if (di->type == T_DIR) {
+      uint p = fs->parent[i];
+      if (p != 0) {
+        struct dinode *pi = Inode(fs, p);
+        for (uint off = 0; off + sizeof(struct dirent) <= pi->size;
+            off += sizeof(struct dirent)) {
+          struct dirent *de = DirEntry(fs, pi, off);
+          if (de != NULL && ChildDirectory(fs, p, de) == i &&
+              strncmp(de->name, "..", DIRSIZ) != 0) {
+            ClearEntry(fs, p, de);
+          }
+        }
+      }
+      fs->parent[i] = lf;
+      SetDotDot(fs, i, lf);
+      Walk(&t, i);
+    }
+  }
+  FreeTree(&t);
+}
+
+// Repairs an image so that CheckImage() passes it, or returns the error
+// that leaves nothing to repair from
+enum fsError RepairImage(struct fsCheck *fs) {
+  uint n = fs->sb.ninodes;
+  AllocState(fs);
+  fs->dirty = calloc(fs->usedWords, sizeof(unsigned long));
+
+  for (uint i = 1; i < n; i++) {
+    RepairInode(fs, i);
+  }
+  if (Inode(fs, ROOTINO)->type != T_DIR) {
+    return ERR_ROOT;
+  }
+  fs->nextFree = fs->dataStart;
+
+  for (uint i = 1; i < n; i++) {
+    if (Inode(fs, i)->type == T_DIR) {
+      RepairDots(fs, i);
+    }
+  }
+  for (int pass = 1; pass >= 0; pass--) {
+    for (uint i = 1; i < n; i++) {
+      if (Inode(fs, i)->type == T_DIR) {
+        RepairEntries(fs, i, pass);
+      }
+    }
+  }
+  for (uint i = ROOTINO + 1; i < n; i++) {
+    if (Inode(fs, i)->type == T_DIR && fs->parent[i] != 0 &&
+        fs->dotdot[i] != fs->parent[i]) {
+      SetDotDot(fs, i, fs->parent[i]);
+    }
+  }
+  RepairOrphans(fs);
+
+  for (uint i = ROOTINO + 1; i < n; i++) {
+    struct dinode *di = Inode(fs, i);
+    if (di->type == T_FILE && di->nlink != fs->refs[i]) {
+      short nlink = fs->refs[i];
+      Report("inode %u: nlink %d set to %d", i, di->nlink, nlink);
+      Change(fs, &di->nlink, &nlink, sizeof(nlink));
+    }
+  }
+
+  // Rebuild the bitmap of data blocks from the blocks inodes own
+  unsigned char *marked = Bitmap(fs);
+  uint flipped = 0;
+  for (uint b = fs->dataStart; b < fs->sb.size; b++) {
+    if (TEST_BIT(fs->used, b) != TEST_BIT(marked, b)) {
+      unsigned char byte = marked[b / 8] ^ (1 << (b % 8));
+      Change(fs, &marked[b / 8], &byte, 1);
+      flipped++;
+    }
+  }
+  if (flipped > 0) {
+    Report("bitmap: %u blocks", flipped);
+  }
+  return FS_OK;
+}
+
+// Reports a failed or short read or write of block b of the image and
+// exits, since a repair cannot go on without the block
+void BlockFailed(char *op, uint b, ssize_t n) {
+  char what[64];
+  snprintf(what, sizeof(what), "%s block %u", op, b);
+  if (n < 0) {
+    perror(what);
+  } else {
+    fprintf(stderr, "%s: %zd of %d bytes\n", what, n, BSIZE);
+  }
+  exit(1);
+}
+
+// Prints each run of changed bytes in the blocks a repair made dirty,
+// as it is in the image file and as the repair leaves it
+// Returns the number of blocks that changed
+uint ShowChanges(struct fsCheck *fs, int img) {
+  unsigned char old[BSIZE];
+  uint changed = 0;
+
+  for (uint b = 0; b < fs->sb.size; b++) {
+    if (!TEST_BIT(fs->dirty, b)) {
+      continue;
+    }
+    ssize_t got = pread(img, old, BSIZE, (off_t)b * BSIZE);
+    if (got != BSIZE) {
+      BlockFailed("read", b, got);
+    }
+    unsigned char *now = Block(fs, b);
+    if (memcmp(old, now, BSIZE) != 0) {
+      changed++;
+    }
+
+    for (uint i = 0; i < BSIZE;) {
+      if (old[i] == now[i]) {
+        i++;
+        continue;
+      }
+      uint j = i;
+      while (j < BSIZE && old[j] != now[j]) {
+        j++;
+      }
+      printf("block %u offset %u:", b, i);
+      for (uint k = i; k < j; k++) {
+        printf(" %02x", old[k]);
+      }
+      printf(" ->");
+      for (uint k = i; k < j; k++) {
+        printf(" %02x", now[k]);
+      }
+      printf("\n");
+      i = j;
+    }
+  }
+  return changed;
+}
+
+// Writes the blocks a repair made dirty back to the image file
+void WriteChanges(struct fsCheck *fs, int img) {
+  for (uint b = 0; b < fs->sb.size; b++) {
+    if (TEST_BIT(fs->dirty, b)) {
+      ssize_t put = pwrite(img, Block(fs, b), BSIZE, (off_t)b * BSIZE);
+      if (put != BSIZE) {
+        BlockFailed("write", b, put);
+      }
+    }
+  }
+  if (fsync(img) != 0) {
+    perror("fsync");
     exit(1);
   }
+}
+
+// Opens the image at path for the given mode, with fs clear, and maps
+// it unless it is to be streamed. Block devices are always streamed
+// when checked, and their size is found by seeking to their end.
+// Only repairs map the image writable.
+// Returns the open image, or -1 if it cannot be opened or mapped
+int OpenImage(struct fsCheck *fs, char *path, int mode, int stream) {
+  memset(fs, 0, sizeof(*fs));
+  int img = open(path, mode == MODE_REPAIR ? O_RDWR : O_RDONLY);
+  if (img == -1) {
+    return -1;
+  }
 
   struct stat imgStat;
   int check;
   check = fstat(img, &imgStat);
   assert(check == 0);
 
-  // Pointer to beginning of FS
-  void* imgPtr = mmap(NULL, imgStat.st_size, PROT_READ, MAP_PRIVATE, img, 0);
-  // First inode block pointer
-  struct superblock *sb = (struct superblock*)(imgPtr + BSIZE);
-  // Inode pointer
-  struct dinode *curr = (struct dinode*) (imgPtr + sb->inodestart * BSIZE);
-
-  for (int i = 0; i < sb->ninodes; i++) {
-    // Inode checks begin
-    struct dinode *di = (struct dinode*) (imgPtr + sb->inodestart * BSIZE);
-    di++;
-
-    for (int j = 0; j < sb->ninodes; j++) {
-      int blocks = 0;
-      // Inode type out of bounds
-      if (di->type > 3 || di->type < 0) {
-        fprintf(stderr, "ERROR: bad inode.\n");
-        exit(1);
-      }
-
-      // Determine size
-      for (int k = 0; k < NDIRECT; k++) {
-        if (di->addrs[k] != 0) {
-          blocks++;
-        }
+  fs->imgSize = imgStat.st_size;
+  if (S_ISBLK(imgStat.st_mode)) {
+    fs->imgSize = lseek(img, 0, SEEK_END);
+    stream = 1;
+  }
+  if (mode == MODE_CHECK && stream) {
+    fs->stream = 1;
+    return img;
+  }
+  // An empty image cannot be mapped; CheckSuperblock reports it as bad
+  // rather than missing
+  if (fs->imgSize == 0) {
+    return img;
+  }
+
+  // Repairs write to the private mapping only, a copy-on-write overlay
+  // of the image
+  int prot = mode == MODE_DRYRUN || mode == MODE_REPAIR ?
+      PROT_READ | PROT_WRITE : PROT_READ;
+  fs->img = mmap(NULL, fs->imgSize, prot, MAP_PRIVATE, img, 0);
+  if (fs->img == MAP_FAILED) {
+    close(img);
+    return -1;
+  }
+  return img;
+}
+
+void CloseImage(struct fsCheck *fs, int img) {
+  FreeState(fs);
+  free(fs->dirty);
+  if (fs->stream) {
+    free(fs->img);
+    free(fs->indirect.blocks);
+    free(fs->indirect.data);
+    free(fs->dirData.blocks);
+    free(fs->dirData.data);
+  } else if (fs->img != NULL) {
+    munmap(fs->img, fs->imgSize);
+  }
+  close(img);
+}
+
+// One image of a batch, and what checking it found
+struct batchImage {
+  char *path;
+  enum fsError err;
+  double ms;
+};
+
+// Images of a batch, handed out to workers in order
+struct batch {
+  struct batchImage *images;
+  uint count;
+  uint size;  // Images allocated
+  uint next;  // Next image a worker takes
+  int stream; // Stream images rather than map them
+};
+
+// Returns a monotonic time in milliseconds
+double Now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+void AddImage(struct batch *b, char *path) {
+  if (b->count == b->size) {
+    b->size = b->size ? 2 * b->size : 64;
+    b->images = realloc(b->images, b->size * sizeof(struct batchImage));
+  }
+  b->images[b->count].path = path;
+  b->images[b->count].err = FS_OK;
+  b->images[b->count].ms = 0;
+  b->count++;
+}
+
+// Adds path to the batch, or if it is a directory, the regular files in
+// it in name order
+void AddImages(struct batch *b, char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    AddImage(b, strdup(path));
+    return;
+  }
+
+  // glob() lists the directory sorted and without hidden files
+  char *pattern = malloc(strlen(path) + 3);
+  sprintf(pattern, "%s/*", path);
+  glob_t files;
+  if (glob(pattern, 0, NULL, &files) == 0) {
+    for (size_t i = 0; i < files.gl_pathc; i++) {
+      if (stat(files.gl_pathv[i], &st) == 0 && S_ISREG(st.st_mode)) {
+        AddImage(b, strdup(files.gl_pathv[i]));
       }
+    }
+    globfree(&files);
+  }
+  free(pattern);
+}
 
-      // Indirect size
-      uint *a = (uint*) (imgPtr + (di->addrs[NDIRECT] * BSIZE));
-      if (di->addrs[NDIRECT]) {
-        for (int j = 0; j < NINDIRECT; j++) {
-          if (*a) {
-            blocks++;
-          }
-          a++;
-        }
-        if (abs((blocks*BSIZE) - di->size) > 512) {
-          fprintf(stderr, "ERROR: bad size in inode.\n");
-          exit(1);
-        }
+// Batch worker: checks images until none are left, each on this thread
+void *BatchWorker(void *arg) {
+  struct batch *b = arg;
+  uint i;
+  while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+    struct batchImage *image = &b->images[i];
+    double start = Now();
+    struct fsCheck fs;
+    int img = OpenImage(&fs, image->path, MODE_CHECK, b->stream);
+    if (img == -1) {
+      image->err = ERR_NOT_FOUND;
+    } else {
+      fs.threads = 1;
+      image->err = fs.stream ? StreamImage(&fs, img) : FS_OK;
+      if (image->err == FS_OK) {
+        image->err = CheckImage(&fs);
+      }
+      CloseImage(&fs, img);
+    }
+    image->ms = Now() - start;
+  }
+  return NULL;
+}
+
+// Prints s as a JSON string
+void PrintJson(char *s) {
+  putchar('"');
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') {
+      printf("\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      printf("\\u%04x", *s);
+    } else {
+      putchar(*s);
+    }
+  }
+  putchar('"');
+}
+
+// Batch mode: checks the images named by paths, directories standing for
+// the images in them, on a pool of workers, and prints one JSON report
+// of the errors and timings. Each image is checked by one worker, so
+// images rather than sweeps are what run in parallel.
+// Returns 1 if any image has an error
+int CheckBatch(char **paths, int n, int workers, int stream) {
+  struct batch b;
+  memset(&b, 0, sizeof(b));
+  b.stream = stream;
+  for (int i = 0; i < n; i++) {
+    AddImages(&b, paths[i]);
+  }
+  if (workers > b.count) {
+    workers = b.count > 0 ? b.count : 1;
+  }
+
+  double start = Now();
+  pthread_t threads[MAX_THREADS];
+  for (int t = 0; t < workers; t++) {
+    pthread_create(&threads[t], NULL, BatchWorker, &b);
+  }
+  for (int t = 0; t < workers; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  double ms = Now() - start;
+
+  uint failed = 0;
+  for (uint i = 0; i < b.count; i++) {
+    failed += b.images[i].err != FS_OK;
+  }
+  printf("{\n  \"workers\": %d,\n  \"images\": %u,\n", workers, b.count);
+  printf("  \"failed\": %u,\n  \"ms\": %.3f,\n", failed, ms);
+  printf("  \"results\": [");
+  for (uint i = 0; i < b.count; i++) {
+    printf(i > 0 ? ",\n    {\"path\": " : "\n    {\"path\": ");
+    PrintJson(b.images[i].path);
+    printf(", \"error\": ");
+    if (b.images[i].err == FS_OK) {
+      printf("null");
+    } else {
+      PrintJson(errorMessages[b.images[i].err]);
+    }
+    printf(", \"ms\": %.3f}", b.images[i].ms);
+    free(b.images[i].path);
+  }
+  printf("\n  ]\n}\n");
+  free(b.images);
+  return failed > 0;
+}
+
+// Layout of one file or directory, as the analyzer sees it
+struct layout {
+  uint inum;
+  short type;
+  uint blocks;    // Data blocks, the indirect block aside
+  uint extents;   // Runs of consecutive data blocks
+  uint gaps;      // Blocks skipped going from one extent to the next
+  uint distance;  // From the inode's block to its first data block
+  uint indirect;  // Indirect block, or 0
+  uint children;  // Directories: entries other than . and ..
+  uint span;      // Directories: first to last block of the children
+};
+
+// What the analyzer learns about an image
+struct analysis {
+  struct layout *files;  // Every inode in use, in inode order
+  uint count;
+  uint dirs;
+  uint contiguous;       // Files of one extent or none
+  uint usedBlocks;       // Data blocks of files, indirect blocks aside
+  uint indirects;
+  uint indirectSlots;    // Entries in use in indirect blocks
+  uint freeBlocks;
+  uint freeRuns;
+  uint largestFree;
+  uint withData;         // Inodes holding a data block
+  unsigned long extents; // Sums over inodes holding data blocks
+  unsigned long gaps;
+  unsigned long distance;
+  unsigned long children;  // Sums over directories
+  unsigned long span;
+  uint extentHist[32];   // Files by extents, in power-of-two buckets
+  uint freeHist[32];     // Free runs by length, in power-of-two buckets
+};
+
+// Power-of-two bucket of n > 0: bucket k holds [2^k, 2^(k+1))
+int Bucket(uint n) {
+  return 31 - __builtin_clz(n);
+}
+
+// Follows the blocks of inode i in file order and records their extents
+// and how far they lie from the inode
+void AnalyzeFile(struct fsCheck *fs, uint i, struct layout *l) {
+  struct dinode *di = Inode(fs, i);
+  uint first = 0;
+  uint last = 0;
+
+  memset(l, 0, sizeof(*l));
+  l->inum = i;
+  l->type = di->type;
+  l->indirect = di->addrs[NDIRECT];
+  for (uint k = 0; k < MAXFILE; k++) {
+    uint b = FileBlock(fs, di, k * BSIZE);
+    if (b == 0) {
+      continue;
+    }
+    if (l->blocks == 0) {
+      first = b;
+    }
+    if (l->blocks == 0 || b != last + 1) {
+      l->extents++;
+      l->gaps += l->blocks == 0 ? 0 : (b > last ? b - last - 1 : last - b + 1);
+    }
+    last = b;
+    l->blocks++;
+  }
+  l->distance = l->blocks == 0 ? 0 : first - IBLOCK(i, fs->sb);
+}
+
+// Records how widely the first blocks of directory d's children are
+// spread across the disk
+void AnalyzeDirectory(struct fsCheck *fs, uint d, struct layout *l) {
+  struct dinode *di = Inode(fs, d);
+  uint lo = UINT32_MAX;
+  uint hi = 0;
+
+  for (uint off = 0; off + sizeof(struct dirent) <= di->size;
+      off += sizeof(struct dirent)) {
+    struct dirent *de = DirEntry(fs, di, off);
+    if (de == NULL || de->inum == 0 || strncmp(de->name, ".", DIRSIZ) == 0 ||
+        strncmp(de->name, "..", DIRSIZ) == 0) {
+      continue;
+    }
+    l->children++;
+    uint b = FileBlock(fs, Inode(fs, de->inum), 0);
+    if (b != 0) {
+      lo = b < lo ? b : lo;
+      hi = b > hi ? b : hi;
+    }
+  }
+  l->span = hi >= lo ? hi - lo : 0;
+}
+
+// Analyzes the layout of an image that has passed CheckImage()
+void Analyze(struct fsCheck *fs, struct analysis *a) {
+  memset(a, 0, sizeof(*a));
+  a->files = malloc(fs->sb.ninodes * sizeof(struct layout));
+
+  for (uint i = ROOTINO; i < fs->sb.ninodes; i++) {
+    struct dinode *di = Inode(fs, i);
+    if (di->type == 0) {
+      continue;
+    }
+    struct layout *l = &a->files[a->count++];
+    AnalyzeFile(fs, i, l);
+    if (di->type == T_DIR) {
+      AnalyzeDirectory(fs, i, l);
+      a->dirs++;
+    }
+    if (di->type == T_DIR) {
+      a->children += l->children;
+      a->span += l->span;
+    }
+    a->usedBlocks += l->blocks;
+    a->contiguous += l->extents <= 1;
+    if (l->blocks > 0) {
+      a->withData++;
+      a->extents += l->extents;
+      a->gaps += l->gaps;
+      a->distance += l->distance;
+      a->extentHist[Bucket(l->extents)]++;
+    }
+    if (l->indirect != 0) {
+      uint *entries = Block(fs, l->indirect);
+      a->indirects++;
+      for (int k = 0; k < NINDIRECT; k++) {
+        a->indirectSlots += entries[k] != 0;
       }
-      di++;
     }
-    // End inode checks
+  }
+
+  unsigned char *marked = Bitmap(fs);
+  uint run = 0;
+  for (uint b = fs->dataStart; b <= fs->sb.size; b++) {
+    if (b < fs->sb.size && !TEST_BIT(marked, b)) {
+      run++;
+      continue;
+    }
+    if (run > 0) {
+      a->freeBlocks += run;
+      a->freeRuns++;
+      a->freeHist[Bucket(run)]++;
+      a->largestFree = run > a->largestFree ? run : a->largestFree;
+    }
+    run = 0;
+  }
+}
+
+// Sorts layouts by most extents first, then by inode
+int CompareExtents(const void *x, const void *y) {
+  const struct layout *a = x;
+  const struct layout *b = y;
+  if (a->extents != b->extents) {
+    return a->extents < b->extents ? 1 : -1;
+  }
+  return a->inum < b->inum ? -1 : a->inum > b->inum;
+}
+
+// Returns sum / n, or 0 if n is 0
+double Mean(unsigned long sum, uint n) {
+  return n > 0 ? (double)sum / n : 0;
+}
+
+// Prints the power-of-two buckets of a histogram that are not empty
+void PrintHistogram(uint *hist, char *what) {
+  printf("  %-16s %s\n", what, "count");
+  for (int k = 0; k < 32; k++) {
+    if (hist[k] == 0) {
+      continue;
+    }
+    char range[32];
+    if (k == 0) {
+      snprintf(range, sizeof(range), "1");
+    } else {
+      snprintf(range, sizeof(range), "%u-%u", 1u << k, (2u << k) - 1);
+    }
+    printf("  %-16s %u\n", range, hist[k]);
+  }
+}
+
+// Most fragmented files printed in the text report
+#define TOP_FRAGMENTED 10
+
+void PrintAnalysisText(struct fsCheck *fs, struct analysis *a) {
+  uint dataBlocks = a->usedBlocks + a->indirects;
+  printf("Inodes in use: %u (%u files and devices, %u directories)\n",
+      a->count, a->count - a->dirs, a->dirs);
+  printf("Data blocks in use: %u of %u; %u indirect (%.1f%%), "
+      "%.1f of %lu entries used on average\n", dataBlocks,
+      fs->sb.size - fs->dataStart, a->indirects,
+      dataBlocks ? 100.0 * a->indirects / dataBlocks : 0,
+      a->indirects ? (double)a->indirectSlots / a->indirects : 0, NINDIRECT);
+  printf("Contiguous: %u of %u (%.1f%%); mean extents %.2f, "
+      "mean blocks skipped %.1f\n", a->contiguous, a->count,
+      a->count ? 100.0 * a->contiguous / a->count : 0,
+      Mean(a->extents, a->withData), Mean(a->gaps, a->withData));
+  PrintHistogram(a->extentHist, "extents");
+  printf("Inode to first data block: mean %.1f blocks\n",
+      Mean(a->distance, a->withData));
+  printf("Children of a directory: mean %.1f, spread over a mean of %.1f "
+      "blocks\n", Mean(a->children, a->dirs), Mean(a->span, a->dirs));
+  printf("Free: %u blocks in %u runs, largest %u\n", a->freeBlocks,
+      a->freeRuns, a->largestFree);
+  PrintHistogram(a->freeHist, "run length");
+
+  qsort(a->files, a->count, sizeof(struct layout), CompareExtents);
+  printf("Most fragmented:\n");
+  printf("  %-8s %-5s %-8s %-8s %-8s %s\n", "inode", "type", "blocks",
+      "extents", "skipped", "distance");
+  for (uint k = 0; k < a->count && k < TOP_FRAGMENTED; k++) {
+    struct layout *l = &a->files[k];
+    if (l->extents <= 1) {
+      break;
+    }
+    printf("  %-8u %-5d %-8u %-8u %-8u %u\n", l->inum, l->type, l->blocks,
+        l->extents, l->gaps, l->distance);
+  }
+}
+
+void PrintHistogramJson(uint *hist) {
+  int first = 1;
+  printf("[");
+  for (int k = 0; k < 32; k++) {
+    if (hist[k] != 0) {
+      printf("%s{\"min\": %u, \"max\": %u, \"count\": %u}",
+          first ? "" : ", ", 1u << k, (2u << k) - 1, hist[k]);
+      first = 0;
+    }
+  }
+  printf("]");
+}
+
+void PrintAnalysisJson(struct fsCheck *fs, struct analysis *a) {
+  printf("{\n  \"inodes\": %u,\n  \"directories\": %u,\n", a->count,
+      a->dirs);
+  printf("  \"dataBlocks\": %u,\n  \"usedBlocks\": %u,\n",
+      fs->sb.size - fs->dataStart, a->usedBlocks + a->indirects);
+  printf("  \"indirectBlocks\": %u,\n  \"indirectEntries\": %u,\n",
+      a->indirects, a->indirectSlots);
+  printf("  \"contiguous\": %u,\n  \"extentHistogram\": ", a->contiguous);
+  PrintHistogramJson(a->extentHist);
+  printf(",\n  \"freeBlocks\": %u,\n  \"freeRuns\": %u,\n", a->freeBlocks,
+      a->freeRuns);
+  printf("  \"largestFreeRun\": %u,\n  \"freeHistogram\": ",
+      a->largestFree);
+  PrintHistogramJson(a->freeHist);
+  printf(",\n  \"files\": [");
+  for (uint k = 0; k < a->count; k++) {
+    struct layout *l = &a->files[k];
+    printf("%s\n    {\"inode\": %u, \"type\": %d, \"blocks\": %u, "
+        "\"extents\": %u, \"skipped\": %u, \"distance\": %u, "
+        "\"indirect\": %u", k ? "," : "", l->inum, l->type, l->blocks,
+        l->extents, l->gaps, l->distance, l->indirect);
+    if (l->type == T_DIR) {
+      printf(", \"children\": %u, \"span\": %u", l->children, l->span);
+    }
+    printf("}");
+  }
+  printf("\n  ]\n}\n");
+}
+
+// What a changed part of an image is, for the image diff
+enum role {
+  R_BOOT,
+  R_SUPER,
+  R_LOG,
+  R_INODE,
+  R_BITMAP,
+  R_DATA,
+  R_INDIRECT,
+  R_FREE,
+  R_BLOCK,  // Image without a good superblock
+};
+
+// File block index standing for an inode's indirect block
+#define INDIRECT_INDEX UINT32_MAX
+
+// One changed part of an image: a block, or for inode and bitmap blocks
+// one inode or one byte of the bitmap
+struct change {
+  enum role role;
+  uint block;
+  uint inum;   // Inode, or owner of a data or indirect block
+  uint index;  // File block of a data block, or first block a bitmap
+               // byte covers
+  int freed;   // Data or indirect block owned only in the old image
+};
+
+// One of the images diffed, and which inode owns each of its blocks
+struct diffImage {
+  struct fsCheck fs;
+  int img;
+  int good;      // Has a good superblock
+  uint *owner;   // Per block: inode owning it, or 0
+  uint *index;   // Per block: its file block in the owner
+};
 
-    // Root directory check
-    if (i == 1) {
-      // The first inode must be a directory
-      if (curr->type != 1) {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        exit(1);
+// Records the owner of every data block of a good image
+void MapOwners(struct diffImage *d) {
+  struct fsCheck *fs = &d->fs;
+  d->owner = calloc(fs->sb.size, sizeof(uint));
+  d->index = calloc(fs->sb.size, sizeof(uint));
+
+  for (uint i = 1; i < fs->sb.ninodes; i++) {
+    struct dinode *di = Inode(fs, i);
+    if (di->type == 0) {
+      continue;
+    }
+    for (int k = 0; k <= NDIRECT; k++) {
+      uint b = di->addrs[k];
+      if (b >= fs->dataStart && b < fs->sb.size) {
+        d->owner[b] = i;
+        d->index[b] = k < NDIRECT ? k : INDIRECT_INDEX;
       }
+    }
+    uint ib = di->addrs[NDIRECT];
+    if (ib < fs->dataStart || ib >= fs->sb.size) {
+      continue;
+    }
+    uint *a = Block(fs, ib);
+    for (int k = 0; k < NINDIRECT; k++) {
+      if (a[k] >= fs->dataStart && a[k] < fs->sb.size) {
+        d->owner[a[k]] = i;
+        d->index[a[k]] = NDIRECT + k;
+      }
+    }
+  }
+}
+
+// Whether change c continues the run of changes from first to last
+int Continues(struct change *first, struct change *last, struct change *c) {
+  if (c->role != last->role || c->freed != last->freed) {
+    return 0;
+  }
+  switch (c->role) {
+  case R_LOG:
+  case R_FREE:
+  case R_BLOCK:
+    return c->block == last->block + 1;
+  case R_INODE:
+    return c->inum == last->inum + 1;
+  case R_BITMAP:
+    return c->index == last->index + 8;
+  case R_DATA:
+    return c->inum == first->inum && c->block == last->block + 1 &&
+        c->index == last->index + 1;
+  default:
+    return 0;
+  }
+}
+
+// Formats "<noun> lo" into buf, or "<noun>s lo-hi" for a longer range
+char *Range(char *buf, char *noun, uint lo, uint hi) {
+  if (lo == hi) {
+    sprintf(buf, "%s %u", noun, lo);
+  } else {
+    sprintf(buf, "%ss %u-%u", noun, lo, hi);
+  }
+  return buf;
+}
+
+// Prints the run of changes from first to last as one line
+void PrintChanges(struct change *first, struct change *last) {
+  char blocks[48];
+  char range[48];
+  Range(blocks, "block", first->block, last->block);
+
+  switch (first->role) {
+  case R_BOOT:
+    printf("boot block\n");
+    break;
+  case R_SUPER:
+    printf("superblock\n");
+    break;
+  case R_LOG:
+    printf("log %s\n", blocks);
+    break;
+  case R_INODE:
+    printf("%s\n", Range(range, "inode", first->inum, last->inum));
+    break;
+  case R_BITMAP:
+    printf("bitmap of %s\n",
+        Range(range, "block", first->index, last->index + 7));
+    break;
+  case R_DATA:
+    printf("inode %u data %s (%s)%s\n", first->inum,
+        Range(range, "byte", first->index * BSIZE,
+            (last->index + 1) * BSIZE - 1),
+        blocks, first->freed ? ", freed" : "");
+    break;
+  case R_INDIRECT:
+    printf("inode %u indirect %s%s\n", first->inum, blocks,
+        first->freed ? ", freed" : "");
+    break;
+  case R_FREE:
+    printf("free %s\n", blocks);
+    break;
+  case R_BLOCK:
+    printf("%s\n", blocks);
+    break;
+  }
+}
+
+// Collects changes and prints each run of them as it ends
+struct changeList {
+  struct change first;
+  struct change last;
+  int open;
+};
+
+void AddChange(struct changeList *list, struct change c) {
+  if (list->open && Continues(&list->first, &list->last, &c)) {
+    list->last = c;
+    return;
+  }
+  if (list->open) {
+    PrintChanges(&list->first, &list->last);
+  }
+  list->first = c;
+  list->last = c;
+  list->open = 1;
+}
 
-      // Verify the inum of the first and second blocks
-      struct dirent *currDir = (struct dirent*)(imgPtr+curr->addrs[0]*BSIZE);
-      struct dirent *parentDir = currDir++;
+// Records the changes in block b, which differs between x and y. Its
+// role comes from the layout of y, or of x if only x has a good
+// superblock; a data block belongs to its owner in y, else in x.
+void DiffBlock(struct changeList *list, struct diffImage *x,
+    struct diffImage *y, uint b) {
+  struct diffImage *layout = y->good ? y : x;
+  struct superblock *sb = &layout->fs.sb;
+  unsigned char *old = x->fs.img + (size_t)b * BSIZE;
+  unsigned char *now = y->fs.img + (size_t)b * BSIZE;
+  struct change c = {R_BLOCK, b, 0, 0, 0};
 
-      if (currDir->inum != ROOTINO || parentDir->inum != ROOTINO) {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        exit(1);
+  if (!x->good && !y->good) {
+    AddChange(list, c);
+  } else if (b < 2) {
+    c.role = b == 0 ? R_BOOT : R_SUPER;
+    AddChange(list, c);
+  } else if (b < sb->inodestart) {
+    c.role = R_LOG;
+    AddChange(list, c);
+  } else if (b < sb->bmapstart) {
+    c.role = R_INODE;
+    for (uint s = 0; s < IPB; s++) {
+      size_t off = s * sizeof(struct dinode);
+      if (memcmp(old + off, now + off, sizeof(struct dinode)) != 0) {
+        c.inum = (b - sb->inodestart) * IPB + s;
+        AddChange(list, c);
       }
-    } else if (i > 1) {  // Current directory check
-      // Check if inode is a directory
-      if (curr->type == 1) {
-        struct dirent *currDir = (struct dirent*)(imgPtr+curr->addrs[0]*BSIZE);
-        // Check if indecies match
-        if (currDir->inum != i) {
-          fprintf(stderr, "ERROR: current directory mismatch.\n");
-          exit(1);
-        }
+    }
+  } else if (b < layout->fs.dataStart) {
+    c.role = R_BITMAP;
+    for (uint k = 0; k < BSIZE; k++) {
+      if (old[k] != now[k]) {
+        c.index = ((b - sb->bmapstart) * BSIZE + k) * 8;
+        AddChange(list, c);
+      }
+    }
+  } else {
+    struct diffImage *d = y->good && b < y->fs.sb.size && y->owner[b] ? y : x;
+    if (d->good && b < d->fs.sb.size && d->owner[b] != 0) {
+      c.inum = d->owner[b];
+      c.index = d->index[b];
+      c.role = c.index == INDIRECT_INDEX ? R_INDIRECT : R_DATA;
+      c.freed = d == x;
+    } else {
+      c.role = R_FREE;
+    }
+    AddChange(list, c);
+  }
+}
+
+// Image diff: prints what changed from the image at oldPath to the one
+// at newPath, one line per run of changes. Identical stretches are
+// skipped a vector at a time with the bitmap sweep's kernel.
+// Returns 0 if the images are the same, 1 if they differ, 2 if one
+// cannot be opened
+int DiffImages(char *oldPath, char *newPath) {
+  struct diffImage images[2];
+  char *paths[2] = {oldPath, newPath};
+
+  for (int k = 0; k < 2; k++) {
+    struct diffImage *d = &images[k];
+    d->img = OpenImage(&d->fs, paths[k], MODE_DIFF, 0);
+    if (d->img == -1) {
+      fprintf(stderr, "%s: %s\n", paths[k], errorMessages[ERR_NOT_FOUND]);
+      return 2;
+    }
+    d->good = CheckSuperblock(&d->fs) == FS_OK;
+    d->owner = NULL;
+    d->index = NULL;
+    if (d->good) {
+      MapOwners(d);
+    }
+  }
+  struct diffImage *x = &images[0];
+  struct diffImage *y = &images[1];
+
+  size_t size = x->fs.imgSize < y->fs.imgSize ? x->fs.imgSize : y->fs.imgSize;
+  uint blocks = size / BSIZE;
+  size_t words = (size_t)blocks * BSIZE / 8;
+  struct changeList list;
+  memset(&list, 0, sizeof(list));
+  uint changed = 0;
+
+  for (size_t w = 0; (w = firstDiff(x->fs.img, y->fs.img, w, words)) < words;
+      w = (w * 8 / BSIZE + 1) * BSIZE / 8) {
+    DiffBlock(&list, x, y, w * 8 / BSIZE);
+    changed++;
+  }
+  if (list.open) {
+    PrintChanges(&list.first, &list.last);
+  }
+
+  int differ = changed > 0 || x->fs.imgSize != y->fs.imgSize;
+  if (x->fs.imgSize != y->fs.imgSize) {
+    struct diffImage *longer = x->fs.imgSize > y->fs.imgSize ? x : y;
+    printf("blocks %u-%lu only in %s\n", blocks,
+        (longer->fs.imgSize + BSIZE - 1) / BSIZE - 1,
+        paths[longer == y]);
+  }
+  printf("%u of %u blocks differ\n", changed, blocks);
+
+  for (int k = 0; k < 2; k++) {
+    free(images[k].owner);
+    free(images[k].index);
+    CloseImage(&images[k].fs, images[k].img);
+  }
+  return differ;
+}
+
+int main(int argc, char* argv[]) {
+  // Threads default to the number of cores; -j sets them. In batch mode
+  // they are the workers checking images. -s streams images with pread
+  // instead of mapping them. -a analyzes the layout of a good image.
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int mode = MODE_CHECK;
+  int batch = 0;
+  int stream = 0;
+  char *analyze = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:bdj:nsy")) != -1) {
+    if (opt == 'a' && (strcmp(optarg, "text") == 0 ||
+        strcmp(optarg, "json") == 0)) {
+      analyze = optarg;
+    } else if (opt == 'd') {
+      mode = MODE_DIFF;
+    } else if (opt == 'b') {
+      batch = 1;
+    } else if (opt == 's') {
+      stream = 1;
+    } else if (opt == 'j') {
+      threads = atoi(optarg);
+    } else if (opt == 'n') {
+      mode = MODE_DRYRUN;
+    } else if (opt == 'y') {
+      mode = MODE_REPAIR;
+    } else {
+      optind = argc;
+      break;
+    }
+  }
+  int images = mode == MODE_DIFF ? 2 : 1;
+  if (batch ? optind >= argc || mode != MODE_CHECK || analyze != NULL :
+      optind != argc - images || (analyze != NULL && mode != MODE_CHECK)) {
+    fprintf(stderr,
+        "Usage: fscheck [-j threads] [-s | -n | -y] <file_system_image>\n"
+        "       fscheck [-j threads] [-s] -a text|json <file_system_image>\n"
+        "       fscheck -b [-j threads] [-s] <image or directory>...\n"
+        "       fscheck -d <old_image> <new_image>\n");
+    exit(1);
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > MAX_THREADS) {
+    threads = MAX_THREADS;
+  }
+  PickKernels();
+  if (batch) {
+    return CheckBatch(argv + optind, argc - optind, threads, stream);
+  }
+  if (mode == MODE_DIFF) {
+    return DiffImages(argv[optind], argv[optind + 1]);
+  }
+
+  // Pointer to beginning of FS
+  struct fsCheck fs;
+  int img = OpenImage(&fs, argv[optind], mode, stream);
+  // Validate FS image
+  if (img == -1) {
+    fprintf(stderr, "%s\n", errorMessages[ERR_NOT_FOUND]);
+    exit(1);
+  }
+  fs.threads = threads;
+
+  enum fsError err = FS_OK;
+  if (mode != MODE_CHECK) {
+    err = CheckSuperblock(&fs);
+    if (err == FS_OK) {
+      err = RepairImage(&fs);
+      FreeState(&fs);
+    }
+    if (err == FS_OK) {
+      uint changed = ShowChanges(&fs, img);
+      if (mode == MODE_REPAIR) {
+        WriteChanges(&fs, img);
       }
-      // Next inode
+      printf("%u blocks %s\n", changed,
+          mode == MODE_REPAIR ? "written" : "would be written");
+    }
+  }
+  if (fs.stream) {
+    err = StreamImage(&fs, img);
+  }
+  // Repaired images are checked again, as repaired
+  if (err == FS_OK) {
+    err = CheckImage(&fs);
+  }
+  if (err == FS_OK && analyze != NULL) {
+    struct analysis a;
+    Analyze(&fs, &a);
+    if (strcmp(analyze, "json") == 0) {
+      PrintAnalysisJson(&fs, &a);
+    } else {
+      PrintAnalysisText(&fs, &a);
     }
-    curr++;
+    free(a.files);
+  }
+  CloseImage(&fs, img);
+  if (err != FS_OK) {
+    fprintf(stderr, "%s\n", errorMessages[err]);
+    exit(1);
   }
+  return 0;
 }
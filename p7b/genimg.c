@@ -0,0 +1,683 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// On-disk file system format.
+// Both the kernel and user programs use this header file.
+
+#define ROOTINO 1  // root i-number
+#define BSIZE 512  // block size
+
+// Disk layout:
+// [ boot block | super block | log | inode blocks |
+//                                          free bit map | data blocks]
+//
+// mkfs computes the super block and builds an initial file system. The
+// super block describes the disk layout:
+struct superblock {
+  uint size;         // Size of file system image (blocks)
+  uint nblocks;      // Number of data blocks
+  uint ninodes;      // Number of inodes.
+  uint nlog;         // Number of log blocks
+  uint logstart;     // Block number of first log block
+  uint inodestart;   // Block number of first inode block
+  uint bmapstart;    // Block number of first free map block
+};
+
+#define NDIRECT 12
+#define NINDIRECT (BSIZE / sizeof(uint))
+#define MAXFILE (NDIRECT + NINDIRECT)
+
+// On-disk inode structure
+struct dinode {
+  short type;           // File type
+  short major;          // Major device number (T_DEV only)
+  short minor;          // Minor device number (T_DEV only)
+  short nlink;          // Number of links to inode in file system
+  uint size;            // Size of file (bytes)
+  uint addrs[NDIRECT+1];   // Data block addresses
+};
+
+// Inodes per block.
+#define IPB           (BSIZE / sizeof(struct dinode))
+
+// Block containing inode i
+#define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
+
+// Bitmap bits per block
+#define BPB           (BSIZE*8)
+
+// Directory is a file containing a sequence of dirent structures.
+#define DIRSIZ 14
+
+struct dirent {
+  ushort inum;
+  char name[DIRSIZ];
+};
+
+// Inode types
+#define T_DIR  1   // Directory
+#define T_FILE 2   // File
+
+// Log blocks, as mkfs lays them out (LOGSIZE in param.h)
+#define NLOG 30
+
+// Inode numbers must fit the ushort of a directory entry, so inodes 0
+// to 65535
+#define MAX_INODES 65536
+
+// Most directory entries a directory can hold
+#define MAX_ENTRIES (MAXFILE * BSIZE / sizeof(struct dirent))
+
+// Most corruptions one image can be given
+#define MAX_CORRUPTIONS 32
+
+// Corruptions genimg can inject, one for each error fscheck reports
+enum corruption {
+  C_BAD_INODE,
+  C_BAD_DIRECT,
+  C_BAD_INDIRECT,
+  C_BAD_SIZE,
+  C_ROOT,
+  C_CURRDIR,
+  C_DIRECT_TWICE,
+  C_INDIRECT_TWICE,
+  C_BITMAP_FREE,
+  C_BITMAP_USED,
+  C_INODE_FREE,
+  C_INODE_UNREFERENCED,
+  C_BAD_REFCOUNT,
+  C_DIR_TWICE,
+  C_PARENT_MISMATCH,
+  C_INACCESSIBLE,
+  NCORRUPTIONS,
+};
+
+// Names of the corruptions for -c
+char *corruptionNames[] = {
+  [C_BAD_INODE] = "badinode",
+  [C_BAD_DIRECT] = "baddirect",
+  [C_BAD_INDIRECT] = "badindirect",
+  [C_BAD_SIZE] = "badsize",
+  [C_ROOT] = "badroot",
+  [C_CURRDIR] = "currdir",
+  [C_DIRECT_TWICE] = "directtwice",
+  [C_INDIRECT_TWICE] = "indirecttwice",
+  [C_BITMAP_FREE] = "unmarked",
+  [C_BITMAP_USED] = "marked",
+  [C_INODE_FREE] = "freeinode",
+  [C_INODE_UNREFERENCED] = "inuseinode",
+  [C_BAD_REFCOUNT] = "refcount",
+  [C_DIR_TWICE] = "dirtwice",
+  [C_PARENT_MISMATCH] = "parent",
+  [C_INACCESSIBLE] = "inaccessible",
+};
+
+// Image being generated
+struct gen {
+  unsigned char *img;
+  struct superblock sb;
+  uint dataStart;   // First data block
+  uint freeInode;   // Next inode to allocate
+  uint freeBlock;   // Next block to allocate; all before it are in use
+  uint blockLimit;  // Blocks from here on stay free, for corruptions
+  uint *parent;     // Per inode: the directory naming it
+  uint *child;      // Per directory: its first subdirectory, or 0
+  uint64_t random;  // State of Random()
+};
+
+// What the tree looks like
+struct shape {
+  uint width;      // Subdirectories per directory
+  uint depth;      // Levels of directories below the root
+  uint files;      // Files per directory
+  uint maxBlocks;  // Most blocks per file
+};
+
+void *Block(struct gen *g, uint b) {
+  return g->img + (size_t)b * BSIZE;
+}
+
+struct dinode *Inode(struct gen *g, uint i) {
+  struct dinode *block = Block(g, IBLOCK(i, g->sb));
+  return block + i % IPB;
+}
+
+// xorshift64*, so an image depends only on its seed
+uint Random(struct gen *g, uint n) {
+  g->random ^= g->random >> 12;
+  g->random ^= g->random << 25;
+  g->random ^= g->random >> 27;
+  return (g->random * 2685821657736338717ULL >> 32) % n;
+}
+
+// Returns the next free block, or 0 if the image is full. The image
+// starts out zeroed, so the block is too.
+uint AllocBlock(struct gen *g) {
+  if (g->freeBlock >= g->blockLimit) {
+    return 0;
+  }
+  return g->freeBlock++;
+}
+
+// Returns the next free inode as an empty inode of the given type, or 0
+// if none is left
+uint AllocInode(struct gen *g, short type) {
+  if (g->freeInode >= g->sb.ninodes) {
+    return 0;
+  }
+  struct dinode *di = Inode(g, g->freeInode);
+  di->type = type;
+  di->nlink = 1;
+  return g->freeInode++;
+}
+
+// Returns the block holding byte off of inode i, allocating it and the
+// indirect block as needed; 0 if the image is full
+uint FileBlock(struct gen *g, uint i, uint off) {
+  struct dinode *di = Inode(g, i);
+  uint k = off / BSIZE;
+  if (k < NDIRECT) {
+    if (di->addrs[k] == 0) {
+      di->addrs[k] = AllocBlock(g);
+    }
+    return di->addrs[k];
+  }
+  if (di->addrs[NDIRECT] == 0 && (di->addrs[NDIRECT] = AllocBlock(g)) == 0) {
+    return 0;
+  }
+  uint *a = Block(g, di->addrs[NDIRECT]);
+  if (a[k - NDIRECT] == 0) {
+    a[k - NDIRECT] = AllocBlock(g);
+  }
+  return a[k - NDIRECT];
+}
+
+// Appends n bytes to inode i, like mkfs's iappend(); a NULL p appends
+// zeroes, which the image already holds. Returns -1 if the image fills.
+int Append(struct gen *g, uint i, void *p, uint n) {
+  struct dinode *di = Inode(g, i);
+  uint off = di->size;
+  while (n > 0) {
+    if (off / BSIZE >= MAXFILE) {
+      return -1;
+    }
+    uint b = FileBlock(g, i, off);
+    if (b == 0) {
+      return -1;
+    }
+    uint n1 = BSIZE - off % BSIZE;
+    n1 = n < n1 ? n : n1;
+    if (p != NULL) {
+      memcpy((unsigned char *)Block(g, b) + off % BSIZE, p, n1);
+      p = (unsigned char *)p + n1;
+    }
+    n -= n1;
+    off += n1;
+    di->size = off;
+  }
+  return 0;
+}
+
+int AddEntry(struct gen *g, uint dir, char *name, uint inum) {
+  struct dirent de;
+  memset(&de, 0, sizeof(de));
+  de.inum = inum;
+  strncpy(de.name, name, DIRSIZ);
+  return Append(g, dir, &de, sizeof(de));
+}
+
+// Returns the entry of directory dir naming inum, or if name is not
+// NULL, the entry with that name; NULL if there is none
+struct dirent *FindEntry(struct gen *g, uint dir, uint inum, char *name) {
+  struct dinode *di = Inode(g, dir);
+  for (uint off = 0; off < di->size; off += sizeof(struct dirent)) {
+    struct dirent *de = (struct dirent *)
+        ((unsigned char *)Block(g, FileBlock(g, dir, off)) + off % BSIZE);
+    if (name != NULL ? strncmp(de->name, name, DIRSIZ) == 0 :
+        de->inum == inum && strncmp(de->name, ".", DIRSIZ) != 0 &&
+        strncmp(de->name, "..", DIRSIZ) != 0) {
+      return de;
+    }
+  }
+  return NULL;
+}
+
+// Whether an inode of the given number of blocks can be made in
+// directory dir; its entry may take a block of dir and an indirect block
+int Room(struct gen *g, uint dir, uint blocks) {
+  return g->freeInode < g->sb.ninodes &&
+      (size_t)g->freeBlock + blocks + 2 <= g->blockLimit &&
+      Inode(g, dir)->size + sizeof(struct dirent) <= MAXFILE * BSIZE;
+}
+
+// Makes a directory in parent, as the kernel's mkdir does; returns its
+// inode, or 0 if the image is full
+uint MakeDir(struct gen *g, uint parent) {
+  if (!Room(g, parent, 1)) {
+    return 0;
+  }
+  uint d = AllocInode(g, T_DIR);
+  char name[DIRSIZ + 1];
+  snprintf(name, sizeof(name), "d%u", d);
+  if (AddEntry(g, d, ".", d) != 0 || AddEntry(g, d, "..", parent) != 0 ||
+      AddEntry(g, parent, name, d) != 0) {
+    return 0;
+  }
+  Inode(g, parent)->nlink++;
+  g->parent[d] = parent;
+  if (g->child[parent] == 0) {
+    g->child[parent] = d;
+  }
+  return d;
+}
+
+// Makes a file of up to maxBlocks blocks in dir, fewer if the image
+// fills; returns its inode, or 0 if there is no room for it
+uint MakeFile(struct gen *g, uint dir, uint maxBlocks) {
+  if (!Room(g, dir, 0)) {
+    return 0;
+  }
+  uint f = AllocInode(g, T_FILE);
+  char name[DIRSIZ + 1];
+  snprintf(name, sizeof(name), "f%u", f);
+  if (AddEntry(g, dir, name, f) != 0) {
+    return 0;
+  }
+  g->parent[f] = dir;
+
+  uint blocks = Random(g, maxBlocks + 1);
+  uint size = blocks == 0 ? 0 : (blocks - 1) * BSIZE + 1 + Random(g, BSIZE);
+  Append(g, f, NULL, size);
+  return f;
+}
+
+// Builds the tree breadth first: every directory gets its files, and
+// those above the deepest level their subdirectories, until the inodes
+// or blocks run out
+void BuildTree(struct gen *g, struct shape *s) {
+  uint *queue = malloc(g->sb.ninodes * sizeof(uint));
+  uint *level = calloc(g->sb.ninodes, sizeof(uint));
+  uint head = 0;
+  uint tail = 0;
+  queue[tail++] = ROOTINO;
+
+  while (head < tail) {
+    uint d = queue[head++];
+    for (uint k = 0; k < s->files; k++) {
+      if (MakeFile(g, d, s->maxBlocks) == 0) {
+        goto full;
+      }
+    }
+    for (uint k = 0; level[d] < s->depth && k < s->width; k++) {
+      uint c = MakeDir(g, d);
+      if (c == 0) {
+        goto full;
+      }
+      level[c] = level[d] + 1;
+      queue[tail++] = c;
+    }
+  }
+full:
+  free(queue);
+  free(level);
+}
+
+// Marks every allocated block in use in the bitmap, as mkfs's balloc()
+void WriteBitmap(struct gen *g) {
+  unsigned char *bitmap = Block(g, g->sb.bmapstart);
+  memset(bitmap, 0xff, g->freeBlock / 8);
+  for (uint b = g->freeBlock / 8 * 8; b < g->freeBlock; b++) {
+    bitmap[b / 8] |= 1 << (b % 8);
+  }
+}
+
+// Counts the blocks a file holds, the indirect block aside
+uint CountBlocks(struct gen *g, struct dinode *di) {
+  uint blocks = 0;
+  for (int k = 0; k < NDIRECT; k++) {
+    blocks += di->addrs[k] != 0;
+  }
+  if (di->addrs[NDIRECT] != 0) {
+    uint *a = Block(g, di->addrs[NDIRECT]);
+    for (int k = 0; k < NINDIRECT; k++) {
+      blocks += a[k] != 0;
+    }
+  }
+  return blocks;
+}
+
+// Whether inode i can be given corruption c
+int Suitable(struct gen *g, enum corruption c, uint i) {
+  struct dinode *di = Inode(g, i);
+  switch (c) {
+  case C_BAD_INODE:
+  case C_BITMAP_USED:
+    return 1;
+  case C_BAD_SIZE:
+  case C_BAD_DIRECT:
+  case C_BITMAP_FREE:
+  case C_INODE_FREE:
+  case C_INODE_UNREFERENCED:
+  case C_BAD_REFCOUNT:
+    return di->type == T_FILE && (c == C_INODE_FREE ||
+        c == C_INODE_UNREFERENCED || c == C_BAD_REFCOUNT ||
+        di->addrs[0] != 0);
+  case C_DIRECT_TWICE:
+    return di->type == T_FILE && di->addrs[1] != 0;
+  case C_BAD_INDIRECT:
+  case C_INDIRECT_TWICE:
+    return di->type == T_FILE && di->addrs[NDIRECT] != 0;
+  case C_ROOT:
+  case C_CURRDIR:
+  case C_PARENT_MISMATCH:
+    return di->type == T_DIR;
+  case C_DIR_TWICE:
+    return di->type == T_DIR && g->parent[i] != ROOTINO;
+  case C_INACCESSIBLE:
+    return di->type == T_DIR && g->child[i] != 0;
+  default:
+    return 0;
+  }
+}
+
+// Picks a random inode other than the root that can be given c, or 0
+uint Victim(struct gen *g, enum corruption c) {
+  uint n = g->freeInode - (ROOTINO + 1);
+  if (n == 0) {
+    return 0;
+  }
+  uint start = Random(g, n);
+  for (uint k = 0; k < n; k++) {
+    uint i = ROOTINO + 1 + (start + k) % n;
+    if (Suitable(g, c, i)) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// Returns a block number past the end of the image, without wrapping
+uint BadBlock(struct gen *g) {
+  uint64_t past = (uint64_t)UINT32_MAX - g->sb.size + 1;
+  return g->sb.size + Random(g, past < 1000 ? past : 1000);
+}
+
+// Injects corruption c into a random inode, blocks, entries or bitmap
+// bits it suits, so that fscheck reports c's error
+// Returns the inode corrupted, or for a free block marked in use, the
+// block; 0 if nothing suits c
+uint Inject(struct gen *g, enum corruption c) {
+  uint i = Victim(g, c);
+  if (i == 0) {
+    return 0;
+  }
+  struct dinode *di = Inode(g, i);
+  uint *a = Block(g, di->addrs[NDIRECT]);
+  unsigned char *bitmap = Block(g, g->sb.bmapstart);
+  uint c2;
+
+  switch (c) {
+  case C_BAD_INODE:
+    di->type = 7;
+    break;
+  case C_BAD_DIRECT:
+    di->addrs[0] = BadBlock(g);
+    break;
+  case C_BAD_INDIRECT:
+    a[0] = BadBlock(g);
+    break;
+  case C_BAD_SIZE:
+    di->size = CountBlocks(g, di) * BSIZE + 1;
+    break;
+  case C_ROOT:
+    FindEntry(g, ROOTINO, 0, "..")->inum = i;
+    break;
+  case C_CURRDIR:
+    FindEntry(g, i, 0, ".")->inum = g->parent[i];
+    break;
+  case C_DIRECT_TWICE:
+    di->addrs[1] = di->addrs[0];
+    break;
+  case C_INDIRECT_TWICE:
+    a[0] = di->addrs[0];
+    break;
+  case C_BITMAP_FREE:
+    bitmap[di->addrs[0] / 8] &= ~(1 << (di->addrs[0] % 8));
+    break;
+  case C_BITMAP_USED:
+    if (g->freeBlock >= g->sb.size) {
+      return 0;
+    }
+    i = g->freeBlock + Random(g, g->sb.size - g->freeBlock);
+    bitmap[i / 8] |= 1 << (i % 8);
+    break;
+  case C_INODE_FREE:
+    memset(di, 0, sizeof(*di));
+    break;
+  case C_INODE_UNREFERENCED:
+    FindEntry(g, g->parent[i], i, NULL)->inum = 0;
+    break;
+  case C_BAD_REFCOUNT:
+    di->nlink++;
+    break;
+  case C_DIR_TWICE:
+    if (AddEntry(g, ROOTINO, "twice", i) != 0) {
+      return 0;
+    }
+    break;
+  case C_PARENT_MISMATCH:
+    FindEntry(g, i, 0, "..")->inum =
+        g->parent[i] == ROOTINO ? i : ROOTINO;
+    break;
+  case C_INACCESSIBLE:
+    // Cut i from its parent and hang it under its own subdirectory,
+    // leaving a cycle the root cannot reach
+    c2 = g->child[i];
+    FindEntry(g, g->parent[i], i, NULL)->inum = 0;
+    if (AddEntry(g, c2, "loop", i) != 0) {
+      return 0;
+    }
+    FindEntry(g, i, 0, "..")->inum = c2;
+    g->parent[i] = c2;
+    break;
+  default:
+    return 0;
+  }
+  return i;
+}
+
+// Parses a whole decimal, octal or hex number of at most max; anything
+// else, a sign included, is an error naming the option
+uint64_t Number(char *arg, int opt, uint64_t max) {
+  char *end;
+  errno = 0;
+  unsigned long long n = isdigit((unsigned char)arg[0]) ?
+      strtoull(arg, &end, 0) : 0;
+  if (!isdigit((unsigned char)arg[0]) || *end != '\0' || errno != 0 ||
+      n > max) {
+    fprintf(stderr, "genimg: -%c takes a number from 0 to %llu\n", opt,
+        (unsigned long long)max);
+    exit(1);
+  }
+  return n;
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: genimg [-b blocks] [-i inodes] [-w width] "
+      "[-d depth] [-f files]\n"
+      "              [-m max_file_blocks] [-s seed] [-c corruption]... "
+      "<image>\n"
+      "Corruptions:");
+  for (int c = 0; c < NCORRUPTIONS; c++) {
+    fprintf(stderr, " %s", corruptionNames[c]);
+  }
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  // Defaults make an image the size of mkfs's
+  uint blocks = 1000;
+  uint inodes = 200;
+  struct shape s = {4, 4, 8, MAXFILE};
+  uint64_t seed = 1;
+  enum corruption corrupt[MAX_CORRUPTIONS];
+  int ncorrupt = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:i:w:d:f:m:s:c:")) != -1) {
+    switch (opt) {
+    case 'b':
+      blocks = Number(optarg, opt, UINT32_MAX);
+      break;
+    case 'i':
+      inodes = Number(optarg, opt, MAX_INODES);
+      break;
+    case 'w':
+      s.width = Number(optarg, opt, MAX_ENTRIES);
+      break;
+    case 'd':
+      s.depth = Number(optarg, opt, UINT32_MAX);
+      break;
+    case 'f':
+      s.files = Number(optarg, opt, MAX_ENTRIES);
+      break;
+    case 'm':
+      s.maxBlocks = Number(optarg, opt, MAXFILE);
+      break;
+    case 's':
+      seed = Number(optarg, opt, UINT64_MAX);
+      break;
+    case 'c': {
+      int c = 0;
+      while (c < NCORRUPTIONS && strcmp(optarg, corruptionNames[c]) != 0) {
+        c++;
+      }
+      if (c == NCORRUPTIONS || ncorrupt == MAX_CORRUPTIONS) {
+        Usage();
+      }
+      corrupt[ncorrupt++] = c;
+      break;
+    }
+    default:
+      Usage();
+    }
+  }
+  if (optind != argc - 1) {
+    Usage();
+  }
+  if (s.width + s.files + 3 > MAX_ENTRIES) {
+    fprintf(stderr, "genimg: directories of at most %lu entries, -w and "
+        "-f together\n", MAX_ENTRIES - 3);
+    exit(1);
+  }
+
+  struct gen g;
+  memset(&g, 0, sizeof(g));
+  g.random = seed * 0x9e3779b97f4a7c15ULL + 1;
+  g.sb.size = blocks;
+  g.sb.ninodes = inodes;
+  g.sb.nlog = NLOG;
+  g.sb.logstart = 2;
+  g.sb.inodestart = 2 + NLOG;
+  g.sb.bmapstart = g.sb.inodestart + inodes / IPB + 1;
+  g.dataStart = g.sb.bmapstart + blocks / BPB + 1;
+  g.sb.nblocks = blocks - g.dataStart;
+
+  // Each marked corruption needs a free data block to mark
+  uint reserve = 0;
+  for (int k = 0; k < ncorrupt; k++) {
+    reserve += corrupt[k] == C_BITMAP_USED;
+  }
+  if (inodes <= ROOTINO || (uint64_t)g.dataStart + reserve >= blocks) {
+    fprintf(stderr, "genimg: %u blocks hold no data next to %u inodes\n",
+        blocks, inodes);
+    exit(1);
+  }
+  g.blockLimit = blocks - reserve;
+
+  // The image is built in a shared mapping of a sparse file, so blocks
+  // that stay zero cost no writes. It goes under a temporary name and
+  // replaces the image only once every corruption is in.
+  char *path = argv[optind];
+  char *tmp = malloc(strlen(path) + 8);
+  sprintf(tmp, "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd < 0) {
+    perror(tmp);
+    exit(1);
+  }
+  mode_t mask = umask(0);
+  umask(mask);
+  if (fchmod(fd, 0666 & ~mask) != 0 ||
+      ftruncate(fd, (off_t)blocks * BSIZE) != 0) {
+    perror(tmp);
+    unlink(tmp);
+    exit(1);
+  }
+  g.img = mmap(NULL, (size_t)blocks * BSIZE, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  if (g.img == MAP_FAILED) {
+    perror("mmap");
+    unlink(tmp);
+    exit(1);
+  }
+  memcpy(Block(&g, 1), &g.sb, sizeof(g.sb));
+  g.freeInode = ROOTINO;
+  g.freeBlock = g.dataStart;
+  g.parent = calloc(inodes, sizeof(uint));
+  g.child = calloc(inodes, sizeof(uint));
+
+  uint root = AllocInode(&g, T_DIR);
+  AddEntry(&g, root, ".", root);
+  AddEntry(&g, root, "..", root);
+  g.parent[root] = root;
+  BuildTree(&g, &s);
+
+  // Corruptions that change bitmap bits go in after the bitmap is made;
+  // the rest before, since they may still allocate blocks
+  for (int pass = 0; pass <= 1; pass++) {
+    if (pass == 1) {
+      WriteBitmap(&g);
+    }
+    for (int k = 0; k < ncorrupt; k++) {
+      int late = corrupt[k] == C_BITMAP_FREE || corrupt[k] == C_BITMAP_USED;
+      if (late != pass) {
+        continue;
+      }
+      uint i = Inject(&g, corrupt[k]);
+      if (i == 0) {
+        fprintf(stderr, "genimg: nothing to inject %s into\n",
+            corruptionNames[corrupt[k]]);
+        unlink(tmp);
+        exit(1);
+      }
+      printf("injected %s at %s %u\n", corruptionNames[corrupt[k]],
+          corrupt[k] == C_BITMAP_USED ? "block" : "inode", i);
+    }
+  }
+
+  printf("%u blocks (%u data, %u in use), %u inodes (%u in use)\n",
+      g.sb.size, g.sb.nblocks, g.freeBlock - g.dataStart, g.sb.ninodes,
+      g.freeInode - ROOTINO);
+  free(g.parent);
+  free(g.child);
+  munmap(g.img, (size_t)blocks * BSIZE);
+  close(fd);
+  if (rename(tmp, path) != 0) {
+    perror(path);
+    unlink(tmp);
+    exit(1);
+  }
+  free(tmp);
+  return 0;
+}